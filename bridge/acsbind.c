@@ -13,62 +13,78 @@ Also manage punctuation pronunciations and word replacements.
 
 
 /* Internationalization support routines */
-/* Switch between unicode and utf8. */
+/* Switch between unicode and utf8.
+ * These keep no state, so the bulk conversions are reentrant. */
 
-static unsigned char *uni_p;
-
-/* assumes there is room at uni_p and advances it accordingly */
-static int uni_1(unsigned int c)
+/* Put c at t, which has room, and return the byte after it. */
+static unsigned char *uni_1(unsigned char *t, unsigned int c)
 {
 	    if(c <= 0x7f) {
-			*uni_p++ = c;
-		return 1;
+			*t++ = c;
+		return t;
 	}
 	    if(c <= 0x7ff) {
-			*uni_p++ = 0xc0 | ((c >> 6) & 0x1f);
-			*uni_p++ = 0x80 | (c & 0x3f);
-		return 2;
+			*t++ = 0xc0 | ((c >> 6) & 0x1f);
+			*t++ = 0x80 | (c & 0x3f);
+		return t;
 	}
 	    if(c <= 0xffff) {
-			*uni_p++ = 0xe0 | ((c >> 12) & 0xf);
-			*uni_p++ = 0x80 | ((c >> 6) & 0x3f);
-			*uni_p++ = 0x80 | (c & 0x3f);
-		return 3;
+			*t++ = 0xe0 | ((c >> 12) & 0xf);
+			*t++ = 0x80 | ((c >> 6) & 0x3f);
+			*t++ = 0x80 | (c & 0x3f);
+		return t;
 	}
 	    if(c <= 0x1fffff) {
-			*uni_p++ = 0xf0 | ((c >> 18) & 7);
-			*uni_p++ = 0x80 | ((c >> 12) & 0x3f);
-			*uni_p++ = 0x80 | ((c >> 6) & 0x3f);
-			*uni_p++ = 0x80 | (c & 0x3f);
-		return 4;
+			*t++ = 0xf0 | ((c >> 18) & 7);
+			*t++ = 0x80 | ((c >> 12) & 0x3f);
+			*t++ = 0x80 | ((c >> 6) & 0x3f);
+			*t++ = 0x80 | (c & 0x3f);
+		return t;
 	}
 	    if(c <= 0x3ffffff) {
-			*uni_p++ = 0xf8 | ((c >> 24) & 3);
-			*uni_p++ = 0x80 | ((c >> 18) & 0x3f);
-			*uni_p++ = 0x80 | ((c >> 12) & 0x3f);
-			*uni_p++ = 0x80 | ((c >> 6) & 0x3f);
-			*uni_p++ = 0x80 | (c & 0x3f);
-		return 5;
+			*t++ = 0xf8 | ((c >> 24) & 3);
+			*t++ = 0x80 | ((c >> 18) & 0x3f);
+			*t++ = 0x80 | ((c >> 12) & 0x3f);
+			*t++ = 0x80 | ((c >> 6) & 0x3f);
+			*t++ = 0x80 | (c & 0x3f);
+		return t;
 	}
 	    if(c <= 0x7fffffff) {
-			*uni_p++ = 0xfc | ((c >> 30) & 1);
-			*uni_p++ = 0x80 | ((c >> 24) & 0x3f);
-			*uni_p++ = 0x80 | ((c >> 18) & 0x3f);
-			*uni_p++ = 0x80 | ((c >> 12) & 0x3f);
-			*uni_p++ = 0x80 | ((c >> 6) & 0x3f);
-			*uni_p++ = 0x80 | (c & 0x3f);
-		return 6;
+			*t++ = 0xfc | ((c >> 30) & 1);
+			*t++ = 0x80 | ((c >> 24) & 0x3f);
+			*t++ = 0x80 | ((c >> 18) & 0x3f);
+			*t++ = 0x80 | ((c >> 12) & 0x3f);
+			*t++ = 0x80 | ((c >> 6) & 0x3f);
+			*t++ = 0x80 | (c & 0x3f);
+		return t;
 	}
-	return 0;
+	return t;
 } /* uni_1 */
 
-static unsigned int utf8_1(void)
+/* bytes that uni_1 would write */
+static int uni_len(unsigned int c)
 {
+	if(c <= 0x7f) return 1;
+	if(c <= 0x7ff) return 2;
+	if(c <= 0xffff) return 3;
+	if(c <= 0x1fffff) return 4;
+	if(c <= 0x3ffffff) return 5;
+	if(c <= 0x7fffffff) return 6;
+	return 0;
+} /* uni_len */
+
+/* Decode one character at *sp and push *sp along. */
+static unsigned int utf8_1(const unsigned char **sp)
+{
+	const unsigned char *s = *sp;
 	unsigned int c;
 	int j;
 	unsigned char mask;
-	unsigned char base = *uni_p++;
-	if(base <= 0x7f) return base;
+	unsigned char base = *s++;
+	if(base <= 0x7f) {
+		*sp = s;
+		return base;
+	}
 	mask = 0x80;
 	j = 0;
 	while(mask&base) {
@@ -76,89 +92,183 @@ static unsigned int utf8_1(void)
 		base &= ~mask;
 		mask >>= 1;
 	}
+	*sp = s;
 	if(j == 1 || j > 6) return '?'; /* malformed */
 	c = base;
 	for(--j; j; --j) {
 		c <<= 6;
-		base = *uni_p;
+		base = *s;
 		if((base & 0xc0) != 0x80) return '?';
 		c |= (base&0x3f);
-		++uni_p;
+		*sp = ++s;
 	}
 	return (c ? c : '?');
 } /* utf8_1 */
 
+/* Ascii goes through 16 characters at a time.
+ * The test is one or over the block, and the loops are simple enough
+ * that the compiler does them with vector instructions. */
+#define ASCIIRUN 16
+
+int acs_uni2utf8_buf(const unsigned int *s, int n, unsigned char *t, int room)
+{
+	const unsigned int *end;
+	unsigned char *t0 = t, *tend;
+	unsigned int or;
+	int need, j;
+
+	if(n < 0) n = acs_unilen(s);
+	end = s + n;
+	/* stop with room for the null and the longest character */
+	tend = (room > 7 ? t + room - 7 : t);
+
+	while(s < end && t < tend) {
+		if(end - s >= ASCIIRUN && tend - t >= ASCIIRUN) {
+			for(or=0, j=0; j<ASCIIRUN; ++j) or |= s[j];
+			if(or <= 0x7f) {
+				for(j=0; j<ASCIIRUN; ++j) t[j] = s[j];
+				s += ASCIIRUN, t += ASCIIRUN;
+				continue;
+			}
+		}
+		t = uni_1(t, *s++);
+	}
+
+	need = t - t0;
+	if(s == end) {
+		if(room) *t = 0;
+		return need;
+	}
+
+	/* out of room; write what fits, up to the first that doesn't,
+	 * so the output is a prefix of the whole, then finish the count */
+	while(s < end) {
+		j = uni_len(*s++);
+		if(need + j >= room) {
+			need += j;
+			break;
+		}
+		t = uni_1(t, s[-1]);
+		need += j;
+	}
+	while(s < end) need += uni_len(*s++);
+	if(room) *t = 0;
+	return need;
+} /* acs_uni2utf8_buf */
+
+int acs_utf82uni_buf(const unsigned char *s, int n, unsigned int *t, int room)
+{
+	const unsigned char *end;
+	unsigned long long w0, w1;
+	int need = 0, j;
+
+	if(n < 0) n = strlen((const char *)s);
+	end = s + n;
+
+	while(s < end) {
+		if(end - s >= ASCIIRUN && room - need > ASCIIRUN) {
+			memcpy(&w0, s, 8);
+			memcpy(&w1, s+8, 8);
+			if(!((w0 | w1) & 0x8080808080808080ULL)) {
+				for(j=0; j<ASCIIRUN; ++j) t[need+j] = s[j];
+				s += ASCIIRUN, need += ASCIIRUN;
+				continue;
+			}
+		}
+		if(need < room - 1) t[need] = utf8_1(&s);
+		else utf8_1(&s);
+		++need;
+	}
+
+	if(room) t[need < room ? need : room-1] = 0;
+	return need;
+} /* acs_utf82uni_buf */
+
 /* This function allocates; you need to free when done. */
 unsigned char *acs_uni2utf8(const unsigned int *ubuf)
 {
-	const unsigned int *t;
+	int n = acs_unilen(ubuf);
+	int l = acs_uni2utf8_buf(ubuf, n, 0, 0);
+	unsigned char *out = malloc(l+1);
+	if(!out) return 0;
+	acs_uni2utf8_buf(ubuf, n, out, l+1);
+	return out;
+} /* uni2utf8 */
+
+/* The same, for the text between two positions in a reading buffer. */
+unsigned char *acs_buf2utf8(const struct acs_readingBuffer *b,
+acs_pos_type from, acs_pos_type to)
+{
+	acs_pos_type p;
 	int l = 0;
-	unsigned char tempbuf[8];
-	char *out;
-	for(t=ubuf; *t; ++t) {
-		uni_p = tempbuf;
-		l += uni_1(*t);
-	}
+	unsigned char *out, *t;
+	if(from < b->start) from = b->start;
+	if(to > b->end) to = b->end;
+	for(p=from; p<to; ++p)
+		l += uni_len(acs_bufchar(b, p));
 	out = malloc(l+1);
 	if(!out) return 0;
-	uni_p = out;
-	for(t=ubuf; *t; ++t)
-		uni_1(*t);
-	*uni_p = 0;
+	t = out;
+	for(p=from; p<to; ++p)
+		t = uni_1(t, acs_bufchar(b, p));
+	*t = 0;
 	return out;
-} /* uni2utf8 */
+} /* buf2utf8 */
 
-/* convert to utf8 then write to a file */
+/* convert to utf8 then write to a file, all in one write */
 void acs_write_mix(int fd, const unsigned int *s, int len)
 {
-static unsigned char buf[256];
-uni_p = buf;
-while(len--) {
-uni_1(*s++);
-if(uni_p - buf < 250) continue;
-write(fd, buf, uni_p - buf);
-uni_p = buf;
+static unsigned char *buf;
+static int room;
+unsigned char *newbuf;
+int l;
+
+l = acs_uni2utf8_buf(s, len, buf, room);
+if(l >= room) {
+newbuf = realloc(buf, l + 256);
+if(newbuf) {
+buf = newbuf;
+room = l + 256;
+acs_uni2utf8_buf(s, len, buf, room);
+} else {
+/* no memory; send what fit in the old buffer, if there was one */
+if(!buf) return;
+l = strlen((char *)buf);
 }
-if(uni_p > buf)
-write(fd, buf, uni_p - buf);
+}
+if(l) write(fd, buf, l);
 } /* acs_write-mix */
 
 /* dest has to have enough room */
 int acs_utf82uni(const unsigned char *ubuf, unsigned int *dest)
 {
-int l = 0;
-	uni_p = (unsigned char *)ubuf;
-	while(*dest++ = utf8_1()) ++l;
-return l;
+	const unsigned char *s = ubuf;
+	int l = 0;
+	while(*dest++ = utf8_1(&s)) ++l;
+	return l;
 } /* acs_utf82uni */
 
-int acs_isalpha(unsigned int c)
-{
-	if(c < 0x80 && isalpha(c)) return 1;
-
-	switch(acs_lang) {
-	case ACS_LANG_DE:
-		if(c == 0xdf) return 1;
-		c |= 0x20;
-		if(c == 0xe4 || c == 0xfc || c == 0xf6) return 1;
-		break;
-
-	case ACS_LANG_PT_BR:
-		c |= 0x20;
-		if( c == 0xe0 || c == 0xe1 || c == 0xe2 || c == 0xe3 || c == 0xe7) return 1;
-		if(c == 0xe9 || c == 0xea || c == 0xed) return 1;
-		if(c == 0xf3 || c == 0xf4 || c == 0xf5 || c == 0xfa || c == 0xfc) return 1;
-		break;
-
-	case ACS_LANG_FR:
-		c |= 0x20;
-		if(c == 0xe0 || c == 0xe8 || c == 0xe9 || c == 0xea || c == 0xee) return 1;
-		if(c == 0xf4 || c == 0xfb) return 1;
-		break;
+/* The entry for c in the tables for the current language.
+ * The adapter sets acs_lang directly, so check it each time;
+ * that's one compare, and the tables are picked again only when it changes. */
+static const unsigned char *uc_index;
+static int uc_lang = -1;
 
+static unsigned short ucEntry(unsigned int c)
+{
+	if(c > 0xffff) return '?';
+	if(acs_lang != uc_lang) {
+		uc_lang = acs_lang;
+		uc_index = acs_uc_index[(uc_lang >= ACS_LANG_NONE && uc_lang <= ACS_LANG_PL) ? uc_lang : ACS_LANG_NONE];
 	}
+	return acs_uc_blocks[uc_index[c>>8]][c&0xff];
+} /* ucEntry */
 
-	return 0;
+#define ucClass(c) (ucEntry(c) >> 8)
+
+int acs_isalpha(unsigned int c)
+{
+	return ucClass(c) & ACS_UC_ALPHA;
 } /* acs_isalpha */
 
 int acs_isdigit(unsigned int c)
@@ -168,13 +278,12 @@ int acs_isdigit(unsigned int c)
 
 int acs_isalnum(unsigned int c)
 {
-	return (acs_isalpha(c) || acs_isdigit(c));
+	return !!(ucClass(c) & (ACS_UC_ALPHA|ACS_UC_DIGIT));
 } /* acs_isalnum */
 
 int acs_isspace(unsigned int c)
 {
-	if(c < 0x80 && isspace(c)) return 1;
-	return 0;
+	return !!(ucClass(c) & ACS_UC_SPACE);
 } /* acs_isspace */
 
 /* this assumes you already know it's alpha */
@@ -210,71 +319,22 @@ return (c & ~0x20);
 /* this assumes you already know it's alpha */
 int acs_isvowel(unsigned int c)
 {
-c = acs_tolower(c);
-// english
-if (c == 'a' || c == 'e' || c == 'i' || c == 'o' || c == 'u' || c == 'y')
-return 1;
-
-// latin 1
-if(c >= 0xc0 && c < 0x100) {
-static const unsigned char wv[] = {
-1,1,1,1,1,1,0,0,1,1,1,1,1,1,1,1,
-1,0,1,1,1,1,1,0,1,1,1,1,1,0,0,0,
-1,1,1,1,1,1,0,0,1,1,1,1,1,1,1,1,
-1,0,1,1,1,1,1,0,1,1,1,1,1,0,0,1,
-};
-return wv[c-0xc0];
-}
-
-// higher voweles not yet implemented
-return 0;
+	return !!(ucClass(c) & ACS_UC_VOWEL);
 } /* acs_isvowel */
 
 /* Turn unicode into lower case ascii, as best we can. */
 char acs_unaccent(unsigned int c)
 {
-	static const char down[256+1] =
-	"\0......\07.\t\n.\f\r.."
-	"................"
-	" !\"#$%&'()*+,-./"
-	"0123456789:;<=>?"
-	"@abcdefghijklmno"
-	"pqrstuvwxyz[\\]^_"
-	"`abcdefghijklmno"
-	"pqrstuvwxyz{|}~\177"
-	"..........s....."
-	"..........s....y"
-	" ..............."
-	"................"
-	"aaaaaaa eeeeiiii"
-	"dnooooo.ouuuuy.s"
-	"aaaaaaaceeeeiiii"
-	".nooooo.ouuuuy.y";
-static const unsigned int in_c[] = {
-0x95, 0x99, 0x9c, 0x9d, 0x91, 0x92, 0x93, 0x94,
-0xa0, 0xad, 0x96, 0x97, 0x85,
-0x2022, 0x25ba, 0x113, 0x2013, 0x2014,
-0x2018, 0x2019, 0x201c, 0x201d, 0x200e,
-0x2010, 0};
-static const char out_c[] =
-"*'`'`'`' ----**`--`'`' -";
-int i;
-
-if(c < 0x100) return down[c];
-
-for(i=0; in_c[i]; ++i)
-if(c == in_c[i]) return out_c[i];
-
-return '?';
+	return ucEntry(c) & 0xff;
 } /* acs_unaccent */
 
 int acs_substring_mix(const char *s, const unsigned int *t)
 {
 int n = 0;
 unsigned int c, d;
-uni_p = (unsigned char *)s;
-while(*uni_p) {
-c = utf8_1();
+const unsigned char *u = (const unsigned char *)s;
+while(*u) {
+c = utf8_1(&u);
 d = *t++;
 // if c is a letter it is lower case by assumption.
 if(acs_isalpha(d)) d = acs_tolower(d);
@@ -779,16 +839,12 @@ static int lowerword(const char *w)
 	unsigned int uc; // unicode of each letter
 
 	while(*w) {
-		uni_p = (unsigned char *)w;
-		uc = utf8_1(); // convert utf8 to unicode
+		uc = utf8_1((const unsigned char **)&w); // convert utf8 to unicode
 		if(!acs_isalpha(uc)) return -1; // not a letter in your language
-		w = (char *)uni_p; // prior call pushes uni_p along
-		
+
 uc = acs_tolower(uc);
 // back to utf8
-		uni_p = (unsigned char *)lp;
-		uni_1(uc);
-		lp = (char *)uni_p;
+		lp = (char *)uni_1((unsigned char *)lp, uc);
 		if(lp > lw_utf8 + WORDLEN) return -6; // too long
 	}
 
@@ -866,8 +922,8 @@ static unsigned int rootword[WORDLEN+16];
 static unsigned int *inline_uni(char *t)
 {
 int i = 0;
-uni_p = (unsigned char *)t;
-while(rootword[i] = utf8_1())
+const unsigned char *u = (const unsigned char *)t;
+while(rootword[i] = utf8_1(&u))
 ++i;
 return rootword;
 } /* inline_uni */
@@ -999,21 +1055,22 @@ unsigned int *acs_replace(const unsigned int *s, int len)
 {
 int i, root;
 char *t;
+unsigned char *lp;
 unsigned int c;
 root_fn f;
 
-uni_p = (unsigned char *)lw_utf8;
+lp = (unsigned char *)lw_utf8;
 for(i=0; i<len; ++i, ++s) {
-if((char *)uni_p - lw_utf8 > WORDLEN) return 0;
+if((char *)lp - lw_utf8 > WORDLEN) return 0;
 c = *s;
 // This should already be a letter, but let's recheck.
 if(!acs_isalpha(c)) return 0;
 c = acs_tolower(c);
 rootword[i] = c;
-uni_1(c);
+lp = uni_1(lp, c);
 }
 rootword[i] = 0;
-*uni_p = 0;
+*lp = 0;
 
 t = fromDictionary(lw_utf8);
 if(t) return inline_uni(t);
@@ -1025,10 +1082,10 @@ root = (*f)(i);
 if(!root) return 0;
 
 /* have to go back to utf8 to do the lookup */
-uni_p = (unsigned char *)lw_utf8;
+lp = (unsigned char *)lw_utf8;
 for(i=0; c = rootword[i]; ++i)
-uni_1(c);
-*uni_p = 0;
+lp = uni_1(lp, c);
+*lp = 0;
 t = fromDictionary(lw_utf8);
 if(!t) return 0;
 // and back to unicode
@@ -1056,6 +1113,7 @@ char *t, *u;
 char save, c;
 char teebit = 0;
 unsigned int p_uc; // punctuation unicode
+const unsigned char *pu;
 
 // leading whitespace doesn't matter
 skipWhite(&s);
@@ -1175,9 +1233,9 @@ if(!c) return 0; // empty line
 t = strpbrk(s, " \t");
 if(t) { save = *t; *t = 0; }
 
-uni_p = (unsigned char *)s;
-p_uc = utf8_1();
-if(*uni_p == 0 || uni_p == (unsigned char *)t) {
+pu = (const unsigned char *)s;
+p_uc = utf8_1(&pu);
+if(*pu == 0 || pu == (unsigned char *)t) {
 punc:
 // cannot leave it with no pronunciation
 if(!t) return -8;
@@ -1254,8 +1312,9 @@ int key, ss, mkcode;
 const char *t;
 
 acs_log("suspend keys\n");
+acs_batchkeys(1);
 acs_clearkeys();
-if(!except) return;
+if(!except) goto done;
 
 for(ss=0; ss<=15; ++ss) {
 for(key=0; key<ACS_NUM_KEYS; ++key) {
@@ -1274,6 +1333,9 @@ acs_setkey(key, ss);
 }
 }
 }
+
+done:
+acs_batchkeys(0);
 } /* acs_suspendkeys */
 
 void acs_resumekeys(void)
@@ -1282,6 +1344,7 @@ int key, ss, teebit, mkcode;
 
 acs_log("resume keys\n");
 
+acs_batchkeys(1);
 acs_clearkeys();
 
 for(key=0; key<ACS_NUM_KEYS; ++key) {
@@ -1297,5 +1360,6 @@ acs_setkey(key, (ss | teebit));
 }
 }
 }
+acs_batchkeys(0);
 } /* acs_resumekeys */
 
@@ -5,6 +5,8 @@ the /dev/acsint device.  This file implements the interface described
 and declared in acsbridge.h.
 *********************************************************************/
 
+#define _GNU_SOURCE // memrchr
+
 #include <errno.h>
 #include <stdlib.h>
 #include <string.h>
@@ -15,9 +17,16 @@ and declared in acsbridge.h.
 #include <unistd.h>
 #include <fcntl.h>
 #include <stdarg.h>
+#include <time.h>
+#include <regex.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/sysmacros.h>
 
 #include <linux/vt.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 #include "acsbridge.h"
 
@@ -28,14 +37,20 @@ and declared in acsbridge.h.
 /* Output buffer could be 40 bytes, except for injectstring() */
 #define OUTBUFSIZE 20000
 /* I assume the screen doesn't have more than 20000 cells,
- * and TTYLOGSIZE is at least 2.5 times 20000.
+ * and TTYLOGRING has room for that many characters and their attributes.
  * 48 rows by 170 columns is, for instance, 8160 */
 #define SCREENCELLS 20000
 #define ATTRIBOFFSET SCREENCELLS
-#define VCREADOFFSET (2*SCREENCELLS)
+/* First position of text in a reading buffer.
+ * 0 means no position, and acs_back() can leave the cursor
+ * one before the start, so that has to be a real position too. */
+#define FIRSTPOS 2
+/* how often to look for idle consoles to pack, in seconds */
+#define IDLECHECK 10
 
 int acs_fd = -1; /* file descriptor for /dev/acsint */
-static int vcs_fd; /* file descriptor for /dev/vcsa */
+int acs_vcs_fd = -1; /* file descriptor for /dev/vcsa */
+static int vcsu_fd = -1; /* /dev/vcsu, the screen in unicode, if the kernel has it */
 
 static unsigned char vcs_header[4];
 /* Make cursor coordinates available to the adapter */
@@ -43,6 +58,18 @@ int acs_vc_nrows, acs_vc_ncols;
 int acs_vc_row, acs_vc_col;
 
 int acs_fgc = 1; // current foreground console
+unsigned int acs_dropped; // events dropped by the driver
+unsigned int acs_overrun; // bytes of tty text lost in the driver
+unsigned long long acs_event_ns;
+static int stampsize; // 8 if the driver is stamping events
+static int protosize; // 8 for the sequence number and position of protocol 2
+static unsigned int next_seq; // sequence number of the next event
+static char seq_known; // next_seq is set, we've seen a numbered event
+/* Where the last catch up of each console ended, in the kernel's ring,
+ * and whether we have asked the driver to send it again. */
+static unsigned int tl_pos[MAX_NR_CONSOLES];
+static char tl_known[MAX_NR_CONSOLES], tl_resync[MAX_NR_CONSOLES];
+static unsigned int ovr_lost[MAX_NR_CONSOLES]; // from the overrun event
 
 int acs_lang = ACS_LANG_EN; /* language that the adapter is running in */
 
@@ -77,6 +104,7 @@ return 0;
 key_handler_t acs_key_h;
 acs_more_handler_t acs_more_h;
 acs_fgc_handler_t acs_fgc_h;
+acs_screen_handler_t acs_screen_h;
 ks_echo_handler_t acs_ks_echo_h;
 
 
@@ -87,9 +115,22 @@ static unsigned char outbuf[OUTBUFSIZE]; /* output buffer for acsint */
 static struct acs_readingBuffer *tty_log[MAX_NR_CONSOLES];
 static struct acs_readingBuffer tty_nomem; /* in case we can't allocate */
 static const char nomem_message[] = "Acsint bridge cannot allocate space for this console";
+static unsigned int nomem_area[64];
 static struct acs_readingBuffer *tl; // current tty log
 static struct acs_readingBuffer screenBuf;
+static unsigned int screen_area[TTYLOGRING];
+int acs_idle_compact = 600;
 static int screenmode; // 1 = screen, 0 = tty log
+
+/* The console rings in the driver, mapped read only, if the driver allows.
+ * Then the catch up is a position in the ring, rather than a copy,
+ * and we can see for ourselves whether there is anything new. */
+static const struct acs_mmap_header *kmap_hdr;
+static long kmap_pagesize;
+static const unsigned char *kmap_rings[MAX_NR_CONSOLES];
+static unsigned int kmap_len[MAX_NR_CONSOLES]; // how much of each is mapped
+static unsigned int kmap_pos[MAX_NR_CONSOLES]; // where we left off
+static unsigned int kmap_gen[MAX_NR_CONSOLES];
 struct acs_readingBuffer *acs_mb; /* manipulation buffer */
 struct acs_readingBuffer *acs_tb; /* tty buffer */
 struct acs_readingBuffer *acs_rb; /* current reading buffer */
@@ -139,42 +180,102 @@ static const unsigned int *cp_lang[] = {0,
 cp437, cp437, cp850,
 };
 
-void acs_vc(void)
+/* The screen snapshot, as read from vcsa and vcsu,
+ * and the one before it, so we only rebuild the rows that changed.
+ * snap_rows is 0 if the screen buffer doesn't hold a snapshot. */
+static unsigned char vcs_buf[4 + 2*SCREENCELLS];
+static unsigned int vcsu_buf[SCREENCELLS];
+static unsigned char prev_vcs[2*SCREENCELLS];
+static unsigned int prev_vcsu[SCREENCELLS];
+static int snap_rows, snap_cols, snap_lang, snap_unicode;
+
+/* Set the screen dimensions and cursor from the vcsa header. */
+static void vcSet(void)
 {
-lseek(vcs_fd, 0, 0);
-read(vcs_fd, vcs_header, 4);
-screenBuf.area[0] = 0;
-screenBuf.start = screenBuf.area + 1;
+/* The screen is laid out flat in the ring, from the first position. */
+screenBuf.area = screen_area;
+screenBuf.ringsize = TTYLOGRING;
+screenBuf.area[FIRSTPOS-1] = 0;
+screenBuf.start = screenBuf.hot = FIRSTPOS;
 acs_vc_nrows = vcs_header[0];
 acs_vc_ncols = vcs_header[1];
 acs_vc_row = vcs_header[3];
 acs_vc_col = vcs_header[2];
 screenBuf.v_cursor = screenBuf.start + acs_vc_row * (acs_vc_ncols+1) + acs_vc_col;
+} /* vcSet */
+
+void acs_vc(void)
+{
+pread(acs_vcs_fd, vcs_header, 4, 0);
+vcSet();
 } /* acs_vc */
 
+int acs_screen_events(void)
+{
+/* Reading the header tells the kernel we've seen the change. */
+acs_vc();
+acs_log("screen %d,%d\n", acs_vc_row, acs_vc_col);
+if(acs_screen_h) acs_screen_h(acs_vc_row, acs_vc_col);
+return 0;
+} // acs_screen_events
+
 void acs_screensnap(void)
 {
 unsigned int *t;
-unsigned char *a, *s;
-int i, j;
-
-acs_vc();
+unsigned char *a;
+const unsigned char *s;
+const unsigned int *u;
+int i, j, nr, cells, unicode;
+
+/* The header and the whole screen in one read */
+nr = pread(acs_vcs_fd, vcs_buf, sizeof(vcs_buf), 0);
+if(nr < 4) return;
+memcpy(vcs_header, vcs_buf, 4);
+vcSet();
+cells = acs_vc_nrows * acs_vc_ncols;
+if(acs_vc_nrows * (acs_vc_ncols+1) > SCREENCELLS) return;
+if(nr < 4 + 2*cells) return;
+
+unicode = (vcsu_fd >= 0 &&
+pread(vcsu_fd, vcsu_buf, 4*cells, 0) == 4*cells);
+
+if(acs_vc_nrows != snap_rows || acs_vc_ncols != snap_cols ||
+unicode != snap_unicode ||
+(!unicode && acs_lang != snap_lang)) {
+/* different shape, rebuild everything */
+snap_rows = 0;
+snap_cols = acs_vc_ncols;
+snap_lang = acs_lang;
+snap_unicode = unicode;
+}
 
-t = screenBuf.start;
-screenBuf.attribs = a = (unsigned char *) (screenBuf.area + ATTRIBOFFSET);
-s = (unsigned char *) (screenBuf.area + VCREADOFFSET);
-read(vcs_fd, s, 2*acs_vc_nrows*acs_vc_ncols);
+screenBuf.attribs = (unsigned char *) (screenBuf.area + ATTRIBOFFSET);
 
 for(i=0; i<acs_vc_nrows; ++i) {
-for(j=0; j<acs_vc_ncols; ++j) {
-*t++ = cp_lang[acs_lang][*s++];
-*a++ = *s++;
+s = vcs_buf + 4 + 2*i*acs_vc_ncols;
+u = vcsu_buf + i*acs_vc_ncols;
+if(snap_rows &&
+!memcmp(s, prev_vcs + 2*i*acs_vc_ncols, 2*acs_vc_ncols) &&
+(!unicode || !memcmp(u, prev_vcsu + i*acs_vc_ncols, 4*acs_vc_ncols)))
+continue;
+memcpy(prev_vcs + 2*i*acs_vc_ncols, s, 2*acs_vc_ncols);
+if(unicode) memcpy(prev_vcsu + i*acs_vc_ncols, u, 4*acs_vc_ncols);
+++screenBuf.gen;
+t = screenBuf.area + screenBuf.start + i*(acs_vc_ncols+1);
+a = screenBuf.attribs + i*(acs_vc_ncols+1);
+for(j=0; j<acs_vc_ncols; ++j, s+=2) {
+t[j] = (unicode ? u[j] : cp_lang[acs_lang][s[0]]);
+if(!t[j]) t[j] = ' ';
+a[j] = s[1];
 }
-*t++ = '\n';
-*a++ = 0; // should this be 7?
+t[j] = '\n';
+a[j] = 0; // should this be 7?
 }
+
+snap_rows = acs_vc_nrows;
+t = screenBuf.area + screenBuf.start + acs_vc_nrows*(acs_vc_ncols+1);
 *t = 0;
-screenBuf.end = t;
+screenBuf.end = t - screenBuf.area;
 } // acs_screensnap
 
 static void screenBlank(void)
@@ -186,47 +287,111 @@ if(!screenmode) return; // should never happen
 top = acs_vc_nrows * (acs_vc_ncols + 1);
 if(top > SCREENCELLS) return; // should never happen
 
-s = screenBuf.area;
+snap_rows = 0; // the snapshot is gone
+++screenBuf.gen;
+s = screenBuf.area + FIRSTPOS-1;
 *s++ = 0;
-screenBuf.v_cursor = screenBuf.cursor = s;
+screenBuf.start = screenBuf.hot = FIRSTPOS;
+screenBuf.v_cursor = screenBuf.cursor = FIRSTPOS;
 for(i=0; i<acs_vc_nrows; ++i) {
 for(j=0; j<acs_vc_ncols; ++j) *s++ = ' ';
 *s++ = '\n';
 }
 *s = 0;
-screenBuf.end = s;
+screenBuf.end = s - screenBuf.area;
 } /* screenBlank */
 
+/* Allocate the tty reading buffer for console mino, if need be. */
+static struct acs_readingBuffer *
+logAlloc(int mino)
+{
+struct acs_readingBuffer *b = tty_log[mino];
+if(b && b != &tty_nomem) {
+/* already allocated, but it may have been packed while idle */
+if(acs_loginflate(b))
+acs_log("cannot inflate %d\n", mino+1);
+return b;
+}
+
+b = malloc(sizeof(struct acs_readingBuffer));
+if(b) acs_log("allocate %d\n", mino+1);
+else b = &tty_nomem;
+tty_log[mino] = b;
+
+b->start = b->hot = b->end = FIRSTPOS;
+b->cold = 0;
+/* The ring is allocated when there is text to put in it. */
+b->area = 0;
+b->ringsize = 0;
+b->packed = 0;
+b->packedlen = 0;
+b->lastuse = time(0);
+b->pp_state = 0;
+b->pp_len = 0;
+if(b == &tty_nomem) {
+b->area = nomem_area;
+b->ringsize = 64;
+int j;
+for(j=0; nomem_message[j]; ++j)
+b->area[FIRSTPOS+j] = nomem_message[j];
+b->end = FIRSTPOS + j;
+}
+
+b->cursor = b->start;
+b->v_cursor = 0;
+memset(b->marks, 0, sizeof(b->marks));
+b->attribs = 0;
+return b;
+} /* logAlloc */
+
 /* check to see if a tty reading buffer has been allocated */
 static void
 checkAlloc(void)
 {
-acs_mb = acs_tb = tty_log[acs_fgc - 1];
-if(acs_tb && acs_tb != &tty_nomem)
-return; /* already allocated */
-
-acs_tb = malloc(sizeof(struct acs_readingBuffer));
-if(acs_tb) acs_log("allocate %d\n", acs_fgc);
-else acs_tb = &tty_nomem;
-tty_log[acs_fgc-1] = acs_mb = acs_tb;
+acs_mb = acs_tb = logAlloc(acs_fgc - 1);
+acs_tb->lastuse = time(0);
+} /* checkAlloc */
 
-acs_tb->start = acs_tb->area + 1;
-acs_tb->area[0] = 0;
-if(acs_tb == &tty_nomem) {
+/* Pack the rings of background consoles that have been idle a while. */
+static void compactIdle(void)
+{
+static time_t lastcheck;
+time_t now = time(0);
+struct acs_readingBuffer *b;
 int j;
-for(j=0; nomem_message[j]; ++j)
-acs_tb->start[j] = nomem_message[j];
-acs_tb->start[j] = 0;
-acs_tb->end = acs_tb->start + j;
-} else {
-acs_tb->end = acs_tb->start;
-acs_tb->area[1] = 0;
+
+if(acs_idle_compact <= 0) return;
+if(now - lastcheck < IDLECHECK) return;
+lastcheck = now;
+
+for(j=0; j<MAX_NR_CONSOLES; ++j) {
+b = tty_log[j];
+if(!b || b == &tty_nomem) continue;
+if(j == acs_fgc-1 || !b->area) continue;
+if(now - b->lastuse < acs_idle_compact) continue;
+if(acs_logcompact(b) == 0)
+acs_log("pack %d, %d bytes\n", j+1, b->packedlen);
 }
+} /* compactIdle */
 
-acs_tb->cursor = acs_tb->start;
-acs_tb->v_cursor = 0;
-acs_tb->attribs = 0;
-} /* checkAlloc */
+void acs_memstats(struct acs_memstats *m)
+{
+const struct acs_readingBuffer *b;
+int j;
+
+memset(m, 0, sizeof(*m));
+for(j=0; j<MAX_NR_CONSOLES; ++j) {
+b = tty_log[j];
+if(!b || b == &tty_nomem) continue;
+++m->logs;
+m->ringbytes += b->ringsize * 4;
+if(b->packed) {
+++m->packed;
+m->packedbytes += b->packedlen;
+}
+m->scrollbytes += acs_scrollbytes(b);
+}
+} /* acs_memstats */
 
 int
 acs_screenmode(int enabled)
@@ -245,9 +410,63 @@ return 0;
 } /* acs_screenmode */
 
 
+// Map the header of the console rings; older drivers don't support this.
+static void kmap_open(void)
+{
+void *p;
+int j;
+
+kmap_pagesize = sysconf(_SC_PAGESIZE);
+p = mmap(0, kmap_pagesize, PROT_READ, MAP_SHARED, acs_fd, 0);
+if(p == MAP_FAILED) {
+acs_log("cannot map the console rings\n");
+return;
+}
+kmap_hdr = p;
+for(j=0; j<MAX_NR_CONSOLES; ++j)
+kmap_pos[j] = kmap_gen[j] = 0;
+} // kmap_open
+
+static void kmap_close(void)
+{
+int j;
+if(!kmap_hdr) return;
+for(j=0; j<MAX_NR_CONSOLES; ++j) {
+if(!kmap_rings[j]) continue;
+munmap((void*)kmap_rings[j], kmap_len[j]);
+kmap_rings[j] = 0;
+}
+munmap((void*)kmap_hdr, kmap_pagesize);
+kmap_hdr = 0;
+} // kmap_close
+
+/* Map the ring for a console, the first time we need it,
+ * and again if its size has changed. */
+static const unsigned char *kmap_ring(int mino, unsigned int size)
+{
+void *p;
+off_t where = kmap_pagesize + (off_t)mino * kmap_hdr->ringsize;
+
+if(kmap_rings[mino] && kmap_len[mino] == size) return kmap_rings[mino];
+if(kmap_rings[mino]) {
+munmap((void*)kmap_rings[mino], kmap_len[mino]);
+kmap_rings[mino] = 0;
+}
+if(!size) return 0; // not allocated
+p = mmap(0, size, PROT_READ, MAP_SHARED, acs_fd, where);
+if(p == MAP_FAILED) {
+acs_log("cannot map ring %d\n", mino+1);
+return 0;
+}
+kmap_len[mino] = size;
+return kmap_rings[mino] = p;
+} // kmap_ring
+
 // Open and close the device.
 
 static int acs_bufsize(int n);
+static int acs_compact(int enabled);
+static int acs_protocol(int version);
 
 int
 acs_open(const char *devname)
@@ -260,19 +479,27 @@ return -1;
 
 if(acs_debug) unlink(debuglog);
 
-vcs_fd = open("/dev/vcsa", O_RDONLY | O_CLOEXEC);
-if(vcs_fd < 0)
+acs_vcs_fd = open("/dev/vcsa", O_RDONLY | O_CLOEXEC);
+if(acs_vcs_fd < 0)
 return -1;
+/* Not an error if this isn't there; older kernels don't have it. */
+vcsu_fd = open("/dev/vcsu", O_RDONLY | O_CLOEXEC);
 
 acs_fd = open(devname, O_RDWR | O_CLOEXEC);
 if(acs_fd < 0) {
-close(vcs_fd);
+close(acs_vcs_fd);
+if(vcsu_fd >= 0) close(vcsu_fd);
+vcsu_fd = -1;
 return -1;
 }
 
+kmap_open();
+
 errno = 0;
 acs_reset_configure();
 acs_bufsize(TTYLOGSIZE);
+acs_compact(1);
+acs_protocol(2);
 
 return acs_fd;
 } // acs_open
@@ -283,6 +510,9 @@ acs_close(void)
 int rc = 0;
 errno = 0;
 if(acs_fd < 0) return 0; // already closed
+kmap_close();
+if(vcsu_fd >= 0) close(vcsu_fd);
+vcsu_fd = -1;
 if(close(acs_fd) < 0)
 rc = -1;
 /* Close it regardless. */
@@ -346,6 +576,112 @@ outbuf[2] = n >> 8;
 return acs_write(3);
 }
 
+int acs_timestamps(int enabled)
+{
+outbuf[0] = ACS_TIMESTAMPS;
+outbuf[1] = enabled;
+if(acs_write(2)) return -1;
+stampsize = (enabled ? 8 : 0);
+acs_event_ns = 0;
+return 0;
+} // acs_timestamps
+
+int acs_async(int enabled)
+{
+int flags;
+
+errno = 0;
+if(acs_fd < 0) {
+errno = ENXIO;
+return -1;
+}
+if(enabled && fcntl(acs_fd, F_SETOWN, getpid()) < 0) return -1;
+flags = fcntl(acs_fd, F_GETFL);
+if(flags < 0) return -1;
+if(enabled) flags |= O_ASYNC;
+else flags &= ~O_ASYNC;
+return fcntl(acs_fd, F_SETFL, flags);
+} // acs_async
+
+/* Ask the driver for new text in utf8, as it stores it. */
+static int acs_compact(int enabled)
+{
+outbuf[0] = ACS_COMPACT;
+outbuf[1] = enabled;
+return acs_write(2);
+}
+
+/* Ask the driver to number its events, so we know if any are lost. */
+static int acs_protocol(int version)
+{
+outbuf[0] = ACS_PROTOCOL;
+outbuf[1] = version;
+if(acs_write(2)) return -1;
+protosize = (version >= 2 ? 8 : 0);
+seq_known = 0;
+memset(tl_known, 0, sizeof(tl_known));
+memset(tl_resync, 0, sizeof(tl_resync));
+memset(ovr_lost, 0, sizeof(ovr_lost));
+return 0;
+} // acs_protocol
+
+/* Ask the driver to send the text of a console again,
+ * from where the last catch up left off. */
+static int acs_resync(int m2)
+{
+unsigned int pos = tl_pos[m2-1];
+outbuf[0] = ACS_RESYNC;
+outbuf[1] = m2;
+memcpy(outbuf+2, &pos, 4);
+return acs_write(6);
+} // acs_resync
+
+/* Length of a run of unicodes in utf8, as the driver logs them. */
+static unsigned int utf8_length(const unsigned int *s, int n)
+{
+unsigned int len = 0;
+while(n--) {
+unsigned int c = *s++;
+len += (c < 0x80 ? 1 : c < 0x800 ? 2 : c < 0x10000 ? 3 : 4);
+}
+return len;
+} // utf8_length
+
+/* A catch up for console m2 runs from start to end in the kernel's ring.
+ * Does it pick up where the last one left off,
+ * allowing for any text the driver says it lost?
+ * Return 1 to accept it, 0 if we have asked for it again. */
+static int catchup_check(int m2, unsigned int start, unsigned int end)
+{
+int mino = m2 - 1;
+unsigned int expect;
+
+if(!protosize) return 1;
+if(mino < 0 || mino >= MAX_NR_CONSOLES) return 1;
+
+expect = tl_pos[mino] + ovr_lost[mino];
+if(tl_known[mino] && start != expect && !tl_resync[mino]) {
+if((int)(start - expect) > 0) {
+/* text is missing, that the driver didn't account for */
+acs_log("catch up %d at %u, expected %u, resync\n", m2, start, expect);
+if(acs_resync(m2) == 0) {
+tl_resync[mino] = 1;
+ovr_lost[mino] = 0;
+return 0;
+}
+} else {
+/* positions went back; the log has been reset */
+acs_log("catch up %d restarts at %u\n", m2, start);
+}
+}
+
+tl_pos[mino] = end;
+tl_known[mino] = 1;
+tl_resync[mino] = 0;
+ovr_lost[mino] = 0;
+return 1;
+} // catchup_check
+
 /* Which sounds are generated automatically? */
 
 int
@@ -485,6 +821,16 @@ outbuf[1] = gap;
 return acs_write(2);
 } // acs_obreak
 
+int acs_ringsize(int minor, int size)
+{
+int shift = 12;
+while(shift < 24 && (1<<shift) < size) ++shift;
+outbuf[0] = ACS_RINGSIZE;
+outbuf[1] = minor;
+outbuf[2] = shift;
+return acs_write(3);
+} // acs_ringsize
+
 /* Use divert to swallow a string.
  * This is not unicode at present. */
 static char *swallow_string;
@@ -630,8 +976,48 @@ return 0;
 
 // set and unset keys
 
+/* A copy of the key tables in the driver.
+ * Within a batch, the key functions only change this copy,
+ * and the whole thing goes down in one write at the end. */
+static unsigned short km_capture[ACS_NUM_KEYS];
+static unsigned short km_passt[ACS_NUM_KEYS];
+static unsigned char km_meta[ACS_NUM_KEYS];
+static int km_batch; // depth of nested batches
+
+int acs_batchkeys(int enabled)
+{
+unsigned char *t;
+
+if(enabled) {
+++km_batch;
+return 0;
+}
+if(!km_batch) return 0;
+if(--km_batch) return 0;
+
+/* send the tables down */
+outbuf[0] = ACS_KEYMAP;
+t = outbuf + 1;
+memcpy(t, km_capture, sizeof(km_capture));
+t += sizeof(km_capture);
+memcpy(t, km_passt, sizeof(km_passt));
+t += sizeof(km_passt);
+memcpy(t, km_meta, sizeof(km_meta));
+t += sizeof(km_meta);
+acs_log("keymap\n");
+return acs_write(t - outbuf);
+} // acs_batchkeys
+
 int acs_setkey(int key, int ss)
 {
+if(key >= 0 && key < ACS_NUM_KEYS) {
+km_capture[key] |= (1 << (ss&0xf));
+if(ss & ACS_KEY_T)
+km_passt[key] |= (1 << (ss&0xf));
+else
+km_passt[key] &= ~(1 << (ss&0xf));
+}
+if(km_batch) return 0;
 outbuf[0] = ACS_SET_KEY;
 outbuf[1] = key;
 outbuf[2] = ss;
@@ -640,6 +1026,11 @@ return acs_write(3);
 
 int acs_unsetkey(int key, int ss)
 {
+if(key >= 0 && key < ACS_NUM_KEYS) {
+km_passt[key] = 0;
+km_capture[key] &= ~(1 << (ss&0xf));
+}
+if(km_batch) return 0;
 outbuf[0] = ACS_UNSET_KEY;
 outbuf[1] = key;
 outbuf[2] = ss;
@@ -648,6 +1039,9 @@ return acs_write(3);
 
 int acs_ismeta(int key, int enabled)
 {
+if(key >= 0 && key < ACS_NUM_KEYS)
+km_meta[key] = enabled;
+if(km_batch) return 0;
 outbuf[0] = ACS_ISMETA;
 outbuf[1] = key;
 outbuf[2] = enabled;
@@ -656,214 +1050,214 @@ return acs_write(3);
 
 int acs_clearkeys(void)
 {
+memset(km_capture, 0, sizeof(km_capture));
+memset(km_passt, 0, sizeof(km_passt));
+memset(km_meta, 0, sizeof(km_meta));
+if(km_batch) return 0;
 outbuf[0] = ACS_CLEAR_KEYS;
 return acs_write(1);
 } // acs_clearkeys
 
-static void
-postprocess(unsigned int *s)
-{
-unsigned int *t, *u;
-int j;
+/* Postprocessing is a state machine, one per console, that sees each
+ * character once, as it comes in, before it goes into the ring.
+ * An escape sequence can be split across reads;
+ * the state carries over to the next chunk. */
+enum {
+PP_GROUND, // plain text
+PP_ESC, // just had escape
+PP_CSI, // escape [ parameters
+PP_CSI_BRACKET, // escape [ [, a linux function key echo, one more char
+PP_ESC_INTER, // escape ( and the like, charset and other designators
+PP_STRING, // osc dcs sos pm apc, up to st or bell
+PP_STRING_ESC, // escape within a string, maybe the start of st
+};
 
-if(!acs_postprocess) return;
+/* Give up on a control sequence, or a string, that runs this long.
+ * It was probably garbage, and we don't want to eat the output after it. */
+#define PP_MAXSEQ 64
+#define PP_MAXSTRING 4096
 
-// in case we had part of an ansi escape code
-s -= 100;
-if(s < tl->start) s = tl->start;
-t = s;
+#define CAN 0x18
+#define SUB 0x1a
+/* control characters that are left in the text */
+#define PP_KEEPCTRL ((1<<'\t') | (1<<'\b') | (1<<'\r') | (1<<'\n') | (1<<'\7'))
 
-while(*s) {
+static unsigned int ppout[INBUFSIZE/4];
 
-// crlf
-if(*s == '\r' && s[1] == '\n' &&
-acs_postprocess&ACS_PP_CRLF) {
-++s;
-continue;
+/* How many characters at s are plain text, no control characters. */
+static int plainrun(const unsigned int *s, int n)
+{
+int k = 0;
+#ifdef __SSE2__
+/* compare unsigned by flipping the sign bit */
+const __m128i bias = _mm_set1_epi32((int)0x80000000);
+const __m128i space = _mm_set1_epi32((int)0x80000020);
+__m128i v;
+int m;
+for(; k+4 <= n; k += 4) {
+v = _mm_xor_si128(_mm_loadu_si128((const __m128i *)(s+k)), bias);
+m = _mm_movemask_ps(_mm_castsi128_ps(_mm_cmplt_epi32(v, space)));
+if(m) return k + __builtin_ctz(m);
 }
+#endif
+for(; k<n && s[k] >= ' '; ++k)  ;
+return k;
+} // plainrun
 
-if(s[0] == '\7' && acs_postprocess&ACS_PP_CTRL_G) {
-++s;
-continue;
-}
+static void lineSync(struct acs_readingBuffer *b);
+static void lineTrim(struct acs_readingBuffer *b);
+static void foldTrim(const struct acs_readingBuffer *b);
 
-/* ^h is backspace.
+/* Take the last character off the end of the ring, as backspace does.
  * Check to see if we have backed over the reading cursor or the marks.
  * Because of the way Jupiter reads, a mark could be at end of buffer.
  * In that case keep it at end of buffer. */
-if(s[0] == '\b' && acs_postprocess&ACS_PP_CTRL_H) {
-++s;
-if(t[-1] == 0) continue; /* buffer was empty */
---t;
-/* Now check the cursor and the marks */
+static void unappend(void)
+{
+acs_pos_type t;
+int j;
+
+t = --tl->end;
+/* The text changed, as far as a sentence read ahead is concerned,
+ * but the line index and the search shadow just lose their tail. */
+++tl->gen;
+lineTrim(tl);
+foldTrim(tl);
 if(tl->cursor && tl->cursor >= t)
 tl->cursor = (t > tl->start ? t-1 : t);
 // marks, but not the last mark, which is continuous reading
-for(j=0; j<27; ++j) {
-u = tl->marks[j];
-if(u && u >= t) tl->marks[j] = 0;
-}
+for(j=0; j<27; ++j)
+if(tl->marks[j] >= t) tl->marks[j] = 0;
 // the continuous reading mark
-if(tl->marks[27] && tl->marks[27] > t)
+if(tl->marks[27] > t)
 tl->marks[27] = t;
-continue;
-}
+} // unappend
 
-/* ansi escape sequences */
-if(*s == '\33' &&ACS_PP_ESCB) {
-for(++s; *s == '\33'; ++s)  ;
---s;
-j = 1;
-if(!s[j]) goto advance;
-if(s[j] != '[') {
-cut_j:
-s += j+1;
-// Could the cursor have read into the escape sequence, then we pulled it back?
-// I assume you didn't have time to set a mark in the middle of the sequence.
-if(tl->cursor && tl->cursor >= t)
-tl->cursor = (t > tl->start ? t-1 : t);
-continue;
-		}
-// escape [ stuff letter
-for(++j; s[j] && j<20; ++j)
-if(s[j] < 256 && isalpha(s[j])) goto cut_j;
-goto advance;
+/* Run n characters at s through the postprocessor, into ppout[].
+ * Backspace or cr lf can reach back into the ring,
+ * but not into scrollback, which is already packed away.
+ * Returns the number of characters left. */
+static int
+postprocess(const unsigned int *s, int n)
+{
+const unsigned int *end = s + n;
+unsigned int *t = ppout;
+unsigned int c, last;
+int k;
+
+while(s < end) {
+if(tl->pp_state == PP_GROUND) {
+k = plainrun(s, end - s);
+memcpy(t, s, k*4);
+t += k, s += k;
+if(s == end) break;
 }
 
-// control chars
-if(*s < ' ' && !strchr("\t\b\r\n\7", *s) &&
-acs_postprocess&ACS_PP_CTRL_OTHER) {
-++s;
+c = *s++;
+
+again:
+switch(tl->pp_state) {
+case PP_ESC:
+if(c == '[') { tl->pp_state = PP_CSI; tl->pp_len = 0; continue; }
+if(c == ']' || c == 'P' || c == 'X' || c == '^' || c == '_') {
+tl->pp_state = PP_STRING;
+tl->pp_len = 0;
 continue;
 }
+if(c >= 0x20 && c <= 0x2f) { tl->pp_state = PP_ESC_INTER; continue; }
+if(c == '\33') continue;
+/* escape and one character, or cancelled */
+tl->pp_state = PP_GROUND;
+/* but any other control is acted on, as it would be in the middle of CSI */
+if(c < ' ' && c != CAN && c != SUB) break;
+continue;
 
-advance:
-*t++ = *s++;
-}
+case PP_CSI:
+if(c == '\33') { tl->pp_state = PP_ESC; continue; }
+if(c == CAN || c == SUB) { tl->pp_state = PP_GROUND; continue; }
+if(c < ' ') break; // a control in the middle is still acted on
+if(c == '[' && !tl->pp_len) { tl->pp_state = PP_CSI_BRACKET; continue; }
+if(c >= 0x40 && c <= 0x7e) { tl->pp_state = PP_GROUND; continue; }
+if(c > 0x7e || ++tl->pp_len > PP_MAXSEQ) tl->pp_state = PP_GROUND;
+continue;
 
-tl->end = t;
-*t = 0;
-} /* postprocess */
+case PP_CSI_BRACKET:
+tl->pp_state = PP_GROUND;
+continue;
 
-void acs_clearbuf(void)
-{
-if(screenmode) return;
-acs_imark_start = 0;
-if(acs_mb && acs_mb != &tty_nomem) {
-acs_mb->end = acs_mb->start;
-memset(acs_mb->marks, 0, sizeof(acs_mb->marks));
-}
-acs_mb->cursor = acs_mb->start;
-} // acs_clearbuf
+case PP_ESC_INTER:
+if(c == '\33') { tl->pp_state = PP_ESC; continue; }
+if(c < ' ' && c != CAN && c != SUB) break;
+if(c < 0x20 || c > 0x2f) tl->pp_state = PP_GROUND;
+continue;
 
-/*********************************************************************
-Read events from the acsint device driver.
-Warning!!  This routine is not rentrant.
-Your handlers should not call acs_events(), even indirectly.
-That means they should not call acs_refresh, acs_keystring, etc.
-The best design simply sets variables, and then, once acs_events()
-returns, you can act on those variables, execute the key command,
-start reading, etc.
-*********************************************************************/
+case PP_STRING:
+if(c == '\33') { tl->pp_state = PP_STRING_ESC; continue; }
+if(c == '\7' || c == CAN || c == SUB ||
+++tl->pp_len > PP_MAXSTRING)
+tl->pp_state = PP_GROUND;
+continue;
 
-int acs_events(void)
-{
-int nr; // number of bytes read
-int i, j;
-int culen; /* catch up length */
-unsigned int *custart; // where does catch up start
-unsigned int *sp; // screen pointer
-int nlen; // length of new area
-int diff;
-int m2;
-char refreshed = 0;
-unsigned int d;
-int lastrow = acs_vc_row, lastcol = acs_vc_col;
+case PP_STRING_ESC:
+/* escape \ is the string terminator; anything else starts a new sequence */
+tl->pp_state = PP_ESC;
+if(c == '\\') { tl->pp_state = PP_GROUND; continue; }
+goto again;
+} // switch
 
-errno = 0;
-if(acs_fd < 0) {
-errno = ENXIO;
-return -1;
+/* A control character, in text or in the middle of a sequence. */
+if(c == '\33' && acs_postprocess&ACS_PP_ESCB) {
+tl->pp_state = PP_ESC;
+continue;
 }
 
-nr = read(acs_fd, inbuf, INBUFSIZE);
-acs_log("acsint read %d bytes\n", nr);
-if(nr < 0)
-return -1;
-
-i = 0;
-while(i <= nr-4) {
-switch(inbuf[i]) {
-case ACS_KEYSTROKE:
-acs_log("key %d,%d\n", inbuf[i+1], inbuf[i+2]);
-// keystroke refreshes automatically in line mode;
-// we have to do it here for screen mode.
-if(screenmode && !refreshed) {
-acs_screensnap();
-if(!acs_mb->cursor)
-acs_mb->cursor = acs_mb->v_cursor;
-refreshed = 1;
+if(c == '\b' && acs_postprocess&ACS_PP_CTRL_H) {
+if(t > ppout) --t;
+else if(tl->end > tl->hot) unappend();
+continue;
 }
-// check for macro here.
-if(acs_key_h != swallow_key_h && acs_key_h != swallow1_h) {
-// get the modified key code.
-int mkcode = acs_build_mkcode(inbuf[i+1], inbuf[i+2]);
-// see if this key has a macro
-char *m = acs_getmacro(mkcode);
-if(m) {
-if(*m == '|')
-system(m+1);
-else
-acs_injectstring(m);
-i += 4;
-break;
+
+if(c == '\n' && acs_postprocess&ACS_PP_CRLF) {
+// crlf becomes lf
+last = 0;
+if(t > ppout) last = t[-1];
+else if(tl->end > tl->hot) last = acs_bufchar(tl, tl->end-1);
+if(last == '\r') {
+if(t > ppout) --t;
+else unappend();
 }
 }
-if(acs_key_h) acs_key_h(inbuf[i+1], inbuf[i + 2], inbuf[i+3]);
-i += 4;
-break;
 
-case ACS_FGC:
-acs_log("fg %d\n", inbuf[i+1]);
-acs_fgc = inbuf[i+1];
-checkAlloc();
-if(screenmode) {
-/* Oops, the checkAlloc function changed acs_mb out from under us. */
-acs_mb = &screenBuf;
-screenBlank();
-memset(acs_mb->marks, 0, sizeof(acs_mb->marks));
+if(c == '\7' && acs_postprocess&ACS_PP_CTRL_G)
+continue;
+
+// control chars
+if(c < ' ' && !(PP_KEEPCTRL & (1<<c)) &&
+acs_postprocess&ACS_PP_CTRL_OTHER)
+continue;
+
+*t++ = c;
 }
-if(acs_fgc_h) acs_fgc_h();
-i += 4;
-break;
 
-case ACS_TTY_MORECHARS:
-if(i > nr-8) break;
-d = *(unsigned int *) (inbuf+i+4);
-acs_log("output echo %d", inbuf[i+1]);
-if(d >= ' ' && d < 0x7f) acs_log("/%c\n", d);
-else acs_log(";%x\n", d);
-/* If echo is nonzero, then the refresh has already been done. */
-if(acs_more_h) acs_more_h(inbuf[i+1], d);
-i += 8;
-break;
+return t - ppout;
+} /* postprocess */
 
-case ACS_REFRESH:
-acs_log("ack refresh\n");
-i += 4;
-break;
+/* Push new characters, from the driver, onto the tty log of console m2.
+ * lastrow and lastcol are the screen cursor before these characters. */
+static void
+newchars(int m2, const unsigned int *s, int culen, int lastrow, int lastcol)
+{
+int j;
+acs_pos_type custart; // where does catch up start
+acs_pos_type newhot, oldest = 0;
+int cap; // how much the ring can hold
+unsigned int *sp; // screen pointer
+int diff;
+unsigned int d;
 
-case ACS_TTY_NEWCHARS:
-/* this is the refresh data in line mode
- * m2 is always the foreground console; we could probably discard it. */
-m2 = inbuf[i+1];
-culen = inbuf[i+2] | ((unsigned short)inbuf[i+3]<<8);
-acs_log("new %d\n", culen);
-i += 4;
-if(!culen) break;
 if(acs_debug) {
 for(j=0; j<culen; ++j) {
-d = * (int*) (inbuf + i + 4*j);
+d = s[j];
 if(d < ' ' || d >= 0x7f)
 acs_log("<%x>", d);
 else
@@ -871,14 +1265,13 @@ acs_log("%c", d);
 }
 acs_log("\n");
 }
-if(nr-i < culen*4) break;
 
-// The reprint detector
-if(screenmode && culen <= 10 &&
+// The reprint detector, foreground console only
+if(screenmode && m2 == acs_fgc && culen <= 10 &&
 acs_postprocess&ACS_PP_CTRL_OTHER) {
-sp = screenBuf.start + lastrow * (acs_vc_ncols+1) + lastcol;
+sp = screenBuf.area + screenBuf.start + lastrow * (acs_vc_ncols+1) + lastcol;
 for(j=0; j<culen; ++j) {
-d = * (int*) (inbuf + i + 4*j);
+d = s[j];
 if(d == '\b') {
 if(lastcol) --lastcol, --sp;
 continue;
@@ -892,10 +1285,10 @@ if(d != '\33') break;
 // Only the really short ones would be used anyways.
 // esc[A and esc[8d
 if(++j == culen) goto inbuffer;
-d = * (int*) (inbuf + i + 4*j);
+d = s[j];
 if(d != '[') goto inbuffer;
 if(++j == culen) goto inbuffer;
-d = * (int*) (inbuf + i + 4*j);
+d = s[j];
 if(d == 'A') {
 if(lastrow) --lastrow, sp -= (acs_vc_ncols+1);
 continue;
@@ -904,28 +1297,27 @@ if(d >= 0x80) goto inbuffer;
 if(!isdigit(d)) goto inbuffer;
 diff = d - '0';
 if(++j == culen) goto inbuffer;
-d = * (int*) (inbuf + i + 4*j);
+d = s[j];
 if(d < 0x80 && isdigit(d)) {
 diff = 10*diff + d - '0';
 if(++j == culen) goto inbuffer;
-d = * (int*) (inbuf + i + 4*j);
+d = s[j];
 }
 if(d == 'd') {
 lastrow = diff - 1;
-sp = screenBuf.start + lastrow * (acs_vc_ncols+1) + lastcol;
+sp = screenBuf.area + screenBuf.start + lastrow * (acs_vc_ncols+1) + lastcol;
 continue;
 }
 goto inbuffer; // unknown escape sequence
 }
 // little cursor motions are done
 for(; j<culen; ++j) {
-d = * (int*) (inbuf + i + 4*j);
+d = s[j];
 if(d != *sp++) break;
 }
 if(j == culen) {
 acs_log("reprint %d\n", culen );
-i += culen*4;
-break;
+return;
 }
 }
 
@@ -933,59 +1325,385 @@ inbuffer:
 tl = tty_log[m2 - 1];
 if(!tl || tl == &tty_nomem) {
 /* not allocated; no room for this data */
-i += culen*4;
-break;
+return;
 }
 
-nlen = tl->end - tl->start + culen;
-diff = nlen - TTYLOGSIZE;
-
-if(diff >= tl->end-tl->start) {
-/* a complete replacement
- * should never be greater; diff = tl->end - tl->start
- * copy the new stuff */
-custart = tl->start;
-memcpy(custart, inbuf+i, TTYLOGSIZE*4);
-tl->end = tl->start + TTYLOGSIZE;
-tl->end[0] = 0;
-tl->cursor = 0;
-memset(tl->marks, 0, sizeof(tl->marks));
-if(!screenmode) acs_imark_start = 0;
-} else {
-if(diff > 0) {
-// partial replacement
-memmove(tl->start, tl->start+diff, (tl->end-tl->start - diff)*4);
-tl->end -= diff;
-if(tl->cursor) {
-tl->cursor -= diff;
-if(tl->cursor < tl->start) tl->cursor = 0;
+/* The ring may have been packed while idle.
+ * If we can't get it back, this text is lost. */
+if(acs_loginflate(tl)) {
+acs_log("cannot inflate %d, %d characters lost\n", m2, culen);
+acs_overrun += culen;
+return;
 }
-if(acs_imark_start && !screenmode) {
-acs_imark_start -= diff;
-if(acs_imark_start < tl->start) acs_imark_start = 0;
+tl->lastuse = time(0);
+
+if(acs_postprocess) {
+culen = postprocess(s, culen);
+s = ppout;
+if(!culen) return;
 }
-for(j=0; j<=27; ++j) {
-if(!tl->marks[j]) continue;
-tl->marks[j] -= diff;
-if(tl->marks[j] < tl->start) tl->marks[j] = 0;
+
+cap = acs_loggrow(tl, tl->end - tl->hot + culen);
+if(cap > TTYLOGSIZE) cap = TTYLOGSIZE;
+if(!cap) return; /* no memory for any ring at all */
+
+/* Only the last TTYLOGSIZE characters can be kept in the ring.
+ * What is about to be overwritten goes to scrollback first,
+ * then anything in the new text that won't fit. */
+newhot = tl->end + culen - cap;
+if(newhot > tl->hot) {
+acs_pos_type p = tl->hot, stop = (newhot < tl->end ? newhot : tl->end);
+while(p < stop) {
+j = tl->ringsize - (p & (tl->ringsize-1));
+if(j > stop - p) j = stop - p;
+oldest = acs_scrollpush(tl, p, tl->area + (p & (tl->ringsize-1)), j);
+p += j;
 }
+if(culen > cap) {
+j = culen - cap;
+oldest = acs_scrollpush(tl, tl->end, s, j);
+tl->end += j;
+s += j;
+culen = cap;
+}
+tl->hot = newhot;
+tl->start = oldest;
 }
-/* copy the new stuff */
+
+/* copy the new stuff into the ring, in two pieces if it wraps */
 custart = tl->end;
-memcpy(custart, inbuf+i, culen*4);
+j = tl->ringsize - (custart & (tl->ringsize-1));
+if(j > culen) j = culen;
+memcpy(tl->area + (custart & (tl->ringsize-1)), s, j*4);
+memcpy(tl->area, s + j, (culen - j)*4);
 tl->end += culen;
-tl->end[0] = 0;
-}
+if(tl->lines) lineSync(tl);
 
-postprocess(custart);
+/* The cursor or a mark that falls off the back is no longer valid.
+ * Nothing else moves. */
+if(tl->cursor < tl->start) tl->cursor = 0;
+if(!screenmode && m2 == acs_fgc && acs_imark_start < tl->start)
+acs_imark_start = 0;
+for(j=0; j<=27; ++j)
+if(tl->marks[j] < tl->start) tl->marks[j] = 0;
 
 /* If you're in screen mode, I haven't moved your reading cursor,
  * or imark _start, or the pointers in marks[], appropriately.
  * See the todo file for tracking the cursor in screen mode. */
+} /* newchars */
+
+/* Decode utf8 text from the driver into unicodes, in kchars[].
+ * The text is n bytes at position from in a ring with the given mask;
+ * pass ~0 for text that is laid out flat.
+ * Returns the number of characters. */
+static unsigned int kchars[TTYLOGSIZE];
+static int
+kdecode(const unsigned char *s, unsigned int mask, unsigned int from, unsigned int n)
+{
+unsigned int end = from + n;
+unsigned int c;
+int k, count = 0;
+
+while(from != end && count < TTYLOGSIZE) {
+c = s[from++ & mask];
+k = 0;
+if(c >= 0xf0) c &= 7, k = 3;
+else if(c >= 0xe0) c &= 0xf, k = 2;
+else if(c >= 0xc0) c &= 0x1f, k = 1;
+else if(c >= 0x80) continue; // stray continuation byte
+for(; k && from != end; --k, ++from) {
+if((s[from & mask] & 0xc0) != 0x80) break;
+c = (c<<6) | (s[from & mask] & 0x3f);
+}
+kchars[count++] = c;
+}
+
+return count;
+} /* kdecode */
+
+/* Bring the tty log of console m2 up to position cup in the mapped ring.
+ * The kernel keeps appending while we copy, and could write over
+ * the oldest characters, so keep clear of the tail by a margin.
+ * This is a seqcount reader: copy the bytes out, then look at head again;
+ * anything that is now more than a ring behind it may have been
+ * overwritten under us, so it is trimmed and counted as overrun.
+ * Text we skip for the margin, or to fit kraw, is counted as well.
+ * If the ring was resized meanwhile, start over. */
+static unsigned char kraw[TTYLOGSIZE];
+static void
+mapped_catchup(int m2, unsigned int cup, int lastrow, int lastcol)
+{
+int mino = m2 - 1;
+const volatile struct acs_mmap_console *mc;
+const unsigned char *ring;
+unsigned int seq, size, head, gen;
+unsigned int from, base, oldest, n, j, lost;
+unsigned int skip_tail, skip_long; // skipped on purpose, counted as overrun
+int tries = 0;
+
+if(mino < 0 || mino >= MAX_NR_CONSOLES) return;
+mc = kmap_hdr->con + mino;
+/* we follow the ring ourselves, and see any overrun directly */
+tl_pos[mino] = cup;
+tl_known[mino] = 1;
+ovr_lost[mino] = 0;
+
+again:
+do {
+seq = mc->seq;
+__sync_synchronize();
+size = mc->size;
+gen = mc->gen;
+head = mc->head;
+__sync_synchronize();
+} while((seq & 1) || seq != mc->seq);
+
+ring = kmap_ring(mino, size);
+if(!ring) return;
+
+if(gen != kmap_gen[mino]) {
+/* The ring has been reset, start from the beginning. */
+kmap_gen[mino] = gen;
+kmap_pos[mino] = 0;
+}
+
+from = kmap_pos[mino];
+/* Text that has left the ring altogether is counted by the driver,
+ * in its OVERRUN event; what we skip short of that is ours to count. */
+oldest = base = (head - from > size ? head - size : from);
+skip_tail = skip_long = 0;
+if(head - from > size - size/8) {
+from = head - (size - size/8);
+if((int)(from - oldest) > 0) skip_tail = from - oldest, oldest = from;
+}
+if(cup - from > TTYLOGSIZE) {
+from = cup - TTYLOGSIZE;
+if((int)(from - oldest) > 0) skip_long = from - oldest;
+}
+if((int)(cup - from) <= 0) {
+/* all of it is too close to the tail */
+kmap_pos[mino] = cup;
+if((int)(cup - base) > 0) {
+acs_log("overrun %d %u bytes, why near the tail\n", m2, cup - base);
+acs_overrun += cup - base;
+}
+return;
+}
+n = cup - from;
+
+/* copy out, in two pieces if it wraps */
+j = size - (from & (size-1));
+if(j > n) j = n;
+memcpy(kraw, ring + (from & (size-1)), j);
+memcpy(kraw + j, ring, n - j);
+__sync_synchronize();
+if(mc->seq != seq) {
+/* resized under us; the positions still hold */
+if(++tries < 4) goto again;
+kmap_pos[mino] = cup;
+acs_log("mapped text unstable\n");
+return;
+}
+if(skip_tail) {
+acs_log("overrun %d %u bytes, why near the tail\n", m2, skip_tail);
+acs_overrun += skip_tail;
+}
+if(skip_long) {
+acs_log("overrun %d %u bytes, why too long\n", m2, skip_long);
+acs_overrun += skip_long;
+}
+head = mc->head;
+lost = 0;
+if(head - from > size) {
+lost = head - size - from;
+if(lost > n) lost = n;
+}
+kmap_pos[mino] = cup;
+if(lost) {
+acs_log("mapped text overrun %u bytes\n", lost);
+acs_overrun += lost;
+}
+
+/* We may have landed in the middle of a character. */
+j = lost;
+while(j < n && (kraw[j] & 0xc0) == 0x80) ++j;
+if(j == n) return;
+acs_log("mapped %d\n", n - j);
+
+n = kdecode(kraw, ~0, j, n - j);
+newchars(m2, kchars, n, lastrow, lastcol);
+} /* mapped_catchup */
+
+void acs_clearbuf(void)
+{
+if(screenmode) return;
+acs_imark_start = 0;
+if(acs_mb && acs_mb != &tty_nomem) {
+/* positions only go up; the old text just falls off the back */
+acs_mb->start = acs_mb->hot = acs_mb->end;
+acs_scrollfree(acs_mb);
+free(acs_mb->lines);
+acs_mb->lines = 0;
+memset(acs_mb->marks, 0, sizeof(acs_mb->marks));
+}
+acs_mb->cursor = acs_mb->start;
+} // acs_clearbuf
+
+/* Parse the nr bytes of events in inbuf.
+ * Each event is the fixed part, then the sequence number and position
+ * under protocol 2, then the timestamp, if any, then any characters. */
+static void parse_events(int nr, int lastrow, int lastcol)
+{
+int i;
+int culen; /* catch up length */
+int m2;
+char refreshed = 0;
+unsigned int d, seq, pos = 0;
+int ext = protosize + stampsize;
+
+i = 0;
+while(i <= nr-4) {
+int fixed = 4;
+if(inbuf[i] == ACS_TTY_MORECHARS || inbuf[i] == ACS_TTY_NEWUTF8 ||
+inbuf[i] == ACS_TTY_MAPPED || inbuf[i] == ACS_OVERRUN)
+fixed = 8;
+if(i > nr-fixed-ext) break;
+if(protosize) {
+memcpy(&seq, inbuf+i+fixed, 4);
+memcpy(&pos, inbuf+i+fixed+4, 4);
+/* Queued events are numbered as they are posted, dropped or not,
+ * so a gap means events were lost.  But the events before a console switch
+ * are skipped on purpose; see ACS_FGC in acsint.txt. */
+switch(inbuf[i]) {
+case ACS_TTY_NEWCHARS: case ACS_TTY_NEWUTF8: case ACS_TTY_MAPPED:
+case ACS_OVERRUN: case ACS_DROPPED:
+break; // made up as we read, not numbered
+default:
+if(seq_known && seq != next_seq && inbuf[i] != ACS_FGC) {
+acs_log("sequence %u, expected %u\n", seq, next_seq);
+acs_dropped += seq - next_seq;
+}
+next_seq = seq + 1;
+seq_known = 1;
+}
+}
+if(stampsize)
+memcpy(&acs_event_ns, inbuf+i+fixed+protosize, 8);
+switch(inbuf[i]) {
+case ACS_KEYSTROKE:
+acs_log("key %d,%d\n", inbuf[i+1], inbuf[i+2]);
+// keystroke refreshes automatically in line mode;
+// we have to do it here for screen mode.
+if(screenmode && !refreshed) {
+acs_screensnap();
+if(!acs_mb->cursor)
+acs_mb->cursor = acs_mb->v_cursor;
+refreshed = 1;
+}
+// check for macro here.
+if(acs_key_h != swallow_key_h && acs_key_h != swallow1_h) {
+// get the modified key code.
+int mkcode = acs_build_mkcode(inbuf[i+1], inbuf[i+2]);
+// see if this key has a macro
+char *m = acs_getmacro(mkcode);
+if(m) {
+if(*m == '|')
+system(m+1);
+else
+acs_injectstring(m);
+i += 4 + ext;
+break;
+}
+}
+if(acs_key_h) acs_key_h(inbuf[i+1], inbuf[i + 2], inbuf[i+3]);
+i += 4 + ext;
+break;
 
+case ACS_FGC:
+acs_log("fg %d\n", inbuf[i+1]);
+acs_fgc = inbuf[i+1];
+checkAlloc();
+if(screenmode) {
+/* Oops, the checkAlloc function changed acs_mb out from under us. */
+acs_mb = &screenBuf;
+screenBlank();
+memset(acs_mb->marks, 0, sizeof(acs_mb->marks));
+}
+if(acs_fgc_h) acs_fgc_h();
+i += 4 + ext;
+break;
+
+case ACS_TTY_MORECHARS:
+d = *(unsigned int *) (inbuf+i+4);
+acs_log("output echo %d", inbuf[i+1]);
+if(d >= ' ' && d < 0x7f) acs_log("/%c\n", d);
+else acs_log(";%x\n", d);
+/* If echo is nonzero, then the refresh has already been done. */
+if(acs_more_h) acs_more_h(inbuf[i+1], d);
+i += 8 + ext;
+break;
+
+case ACS_REFRESH:
+acs_log("ack refresh\n");
+i += 4 + ext;
+break;
+
+case ACS_DROPPED:
+d = inbuf[i+2] | ((unsigned short)inbuf[i+3]<<8);
+acs_log("dropped %d\n", d);
+/* under protocol 2 the gap in the numbers is counted instead */
+if(!protosize) acs_dropped += d;
+i += 4 + ext;
+break;
+
+case ACS_OVERRUN:
+/* tty text was lost; the catch up for this console comes next */
+m2 = inbuf[i+1];
+d = *(unsigned int *) (inbuf+i+4);
+acs_log("overrun %d %u bytes, why %d\n", m2, d, inbuf[i+2]);
+acs_overrun += d;
+if(m2 > 0 && m2 <= MAX_NR_CONSOLES)
+ovr_lost[m2-1] += d;
+i += 8 + ext;
+break;
+
+case ACS_TTY_NEWCHARS:
+/* this is the refresh data in line mode
+ * m2 is always the foreground console; we could probably discard it. */
+m2 = inbuf[i+1];
+culen = inbuf[i+2] | ((unsigned short)inbuf[i+3]<<8);
+acs_log("new %d\n", culen);
+i += 4 + ext;
+if(!culen) break;
+if(nr-i < culen*4) break;
+if(catchup_check(m2,
+pos - utf8_length((unsigned int *)(inbuf+i), culen), pos))
+newchars(m2, (unsigned int *)(inbuf+i), culen, lastrow, lastcol);
 i += culen*4;
 break;
 
+case ACS_TTY_NEWUTF8:
+/* Same as above, but in utf8, padded out to a multiple of 4 */
+m2 = inbuf[i+1];
+d = *(unsigned int *) (inbuf+i+4);
+acs_log("new utf8 %d\n", d);
+i += 8 + ext;
+if(nr-i < (int)((d+3) & ~3)) break;
+if(catchup_check(m2, pos - d, pos)) {
+culen = kdecode(inbuf+i, ~0, 0, d);
+if(culen) newchars(m2, kchars, culen, lastrow, lastcol);
+}
+i += (d+3) & ~3;
+break;
+
+case ACS_TTY_MAPPED:
+/* The new characters are in the ring that we have mapped. */
+m2 = inbuf[i+1];
+d = *(unsigned int *) (inbuf+i+4);
+i += 8 + ext;
+mapped_catchup(m2, d, lastrow, lastcol);
+break;
+
 default:
 /* Perhaps a phase error.
  * Not sure what to do here.
@@ -995,20 +1713,116 @@ i += 4;
 } // switch
 } // looping through events
 
+compactIdle();
+} // parse_events
+
+/*********************************************************************
+Read events from the acsint device driver.
+Warning!!  This routine is not rentrant.
+Your handlers should not call acs_events(), even indirectly.
+That means they should not call acs_refresh, acs_keystring, etc.
+The best design simply sets variables, and then, once acs_events()
+returns, you can act on those variables, execute the key command,
+start reading, etc.
+*********************************************************************/
+
+/* If acs_fd is nonblocking, read until the queue is empty,
+ * so an edge triggered wakeup is never left half used.
+ * A blocking fd gets one read, since another could wait. */
+int acs_events(void)
+{
+int nr; // number of bytes read
+int lastrow = acs_vc_row, lastcol = acs_vc_col;
+int nonblock;
+
+errno = 0;
+if(acs_fd < 0) {
+errno = ENXIO;
+return -1;
+}
+nonblock = (fcntl(acs_fd, F_GETFL) & O_NONBLOCK);
+
+nr = read(acs_fd, inbuf, INBUFSIZE);
+acs_log("acsint read %d bytes\n", nr);
+if(nr < 0) {
+/* nothing queued after all */
+if(nonblock && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+errno = 0;
+return 0;
+}
+return -1;
+}
+
+while(1) {
+parse_events(nr, lastrow, lastcol);
+if(!nonblock) break;
+lastrow = acs_vc_row, lastcol = acs_vc_col;
+do nr = read(acs_fd, inbuf, INBUFSIZE);
+while(nr < 0 && errno == EINTR);
+if(nr < 0) {
+if(errno == EAGAIN || errno == EWOULDBLOCK) break;
+return -1;
+}
+acs_log("acsint read %d bytes\n", nr);
+if(!nr) break;
+}
+
+errno = 0;
 return 0;
 } // acs_events
 
 int acs_refresh(void)
 {
+const volatile struct acs_mmap_console *mc;
+
+/* With the rings mapped, we can skip the round trip
+ * if there is nothing new. */
+if(kmap_hdr) {
+mc = kmap_hdr->con + acs_fgc - 1;
+if(mc->gen == kmap_gen[acs_fgc-1] && mc->head == kmap_pos[acs_fgc-1])
+return 0;
+}
+
 acs_log("get refresh\n");
 outbuf[0] = ACS_REFRESH;
 if(acs_write(1)) return -1;
 return acs_events();
 } // acs_refresh
 
+int acs_bg_refresh(void)
+{
+int j, nr;
+const volatile struct acs_mmap_console *mc;
+
+errno = 0;
+if(acs_fd < 0) {
+errno = ENXIO;
+return -1;
+}
+
+for(j=0; j<MAX_NR_CONSOLES; ++j) {
+if(j == acs_fgc-1) continue;
+if(kmap_hdr) {
+/* The header tells us which consoles have something new. */
+mc = kmap_hdr->con + j;
+if(!mc->size) continue;
+if(mc->gen == kmap_gen[j] && mc->head == kmap_pos[j]) continue;
+} else if(!tty_log[j]) continue;
+if(logAlloc(j) == &tty_nomem) continue;
+
+nr = pread(acs_fd, inbuf, INBUFSIZE, j+1);
+if(nr <= 0) continue;
+/* Only catch up records come back, so this is like any other read. */
+acs_log("bg %d read %d bytes\n", j+1, nr);
+parse_events(nr, 0, 0);
+}
+
+return 0;
+} // acs_bg_refresh
+
 
 // cursor commands.
-static unsigned int *tc; // temp cursor
+static acs_pos_type tc; // temp cursor
 
 void acs_cursorset(void)
 {
@@ -1027,9 +1841,17 @@ return tc != 0;
 
 unsigned int acs_getc(void)
 {
-return (tc ? *tc : 0);
+return (tc ? acs_bufchar(acs_mb, tc) : 0);
 } // acs_getc
 
+unsigned int acs_bufchar(const struct acs_readingBuffer *b, acs_pos_type pos)
+{
+if(!pos || pos < b->start || pos >= b->end) return 0;
+if(pos < b->hot) return acs_scrollchar(b, pos);
+if(!b->area) return 0; /* packed while idle */
+return b->area[pos & (b->ringsize-1)];
+} // acs_bufchar
+
 int acs_forward(void)
 {
 if(acs_mb->end == acs_mb->start) return 0;
@@ -1046,11 +1868,113 @@ if(tc-- == acs_mb->start) return 0;
 return 1;
 } // acs_back
 
+/* The line index: the positions of the newlines in a buffer, in order,
+ * nl[first] through nl[count-1], for the text from start up to where.
+ * It is made the first time you move by lines, and after that
+ * newchars() keeps it up to date, so a line move is a binary search.
+ * If the text is changed in place, as the screen is,
+ * the generation number says to build it again. */
+struct acs_lineindex {
+	unsigned int gen;
+	acs_pos_type where;
+	int first, count, room;
+	acs_pos_type nl[0];
+};
+
+/* The first entry at or after pos, from first to count */
+static int lineFind(const struct acs_lineindex *li, acs_pos_type pos)
+{
+int lo = li->first, hi = li->count, mid;
+while(lo < hi) {
+mid = (lo + hi) / 2;
+if(li->nl[mid] < pos) lo = mid + 1;
+else hi = mid;
+}
+return lo;
+} // lineFind
+
+/* Bring the index up to the end of the buffer.
+ * If there isn't memory, the index goes away,
+ * and the line commands walk the text as they always did. */
+static void lineSync(struct acs_readingBuffer *b)
+{
+struct acs_lineindex *li = b->lines;
+acs_pos_type p;
+int room;
+
+if(!li) {
+li = malloc(sizeof(struct acs_lineindex) + 256*sizeof(acs_pos_type));
+if(!li) return;
+li->room = 256;
+li->gen = b->gen + 1;
+b->lines = li;
+}
+
+if(li->gen != b->gen || li->where < b->start || li->where > b->end) {
+li->gen = b->gen;
+li->where = b->start;
+li->first = li->count = 0;
+}
+
+/* forget the lines that fell off the back */
+li->first = lineFind(li, b->start);
+if(li->first > li->count / 2) {
+memmove(li->nl, li->nl + li->first, (li->count - li->first) * sizeof(acs_pos_type));
+li->count -= li->first;
+li->first = 0;
+}
+
+for(p=li->where; p<b->end; ++p) {
+if(acs_bufchar(b, p) != '\n') continue;
+if(li->count == li->room) {
+room = li->room * 2;
+li = realloc(li, sizeof(struct acs_lineindex) + room*sizeof(acs_pos_type));
+if(!li) {
+free(b->lines);
+b->lines = 0;
+return;
+}
+li->room = room;
+b->lines = li;
+}
+li->nl[li->count++] = p;
+}
+li->where = b->end;
+} // lineSync
+
+/* Text came off the end of the buffer, and gen was bumped for it.
+ * An index that was current up to then stays current. */
+static void lineTrim(struct acs_readingBuffer *b)
+{
+struct acs_lineindex *li = b->lines;
+if(!li || li->gen + 1 != b->gen) return;
+li->gen = b->gen;
+if(li->where <= b->end) return;
+while(li->count > li->first && li->nl[li->count-1] >= b->end)
+--li->count;
+li->where = b->end;
+} // lineTrim
+
+static struct acs_lineindex *lineIndex(void)
+{
+lineSync(acs_mb);
+return acs_mb->lines;
+} // lineIndex
+
 int acs_startline(void)
 {
-int colno = 0;
+const struct acs_lineindex *li;
+acs_pos_type p;
+int k, colno = 0;
 if(acs_mb->end == acs_mb->start) return 0;
 if(!tc) return 0;
+if((li = lineIndex())) {
+k = lineFind(li, tc);
+p = (k > li->first ? li->nl[k-1] + 1 : acs_mb->start);
+colno = tc - p + 1;
+tc = p;
+return colno;
+}
 do ++colno;
 while(acs_back() && acs_getc() != '\n');
 acs_forward();
@@ -1059,8 +1983,15 @@ return colno;
 
 int acs_endline(void)
 {
+const struct acs_lineindex *li;
+int k;
 if(acs_mb->end == acs_mb->start) return 0;
 if(!tc) return 0;
+if((li = lineIndex())) {
+k = lineFind(li, tc);
+tc = (k < li->count ? li->nl[k] : acs_mb->end - 1);
+return 1;
+}
 while(acs_getc() != '\n') {
 if(acs_forward()) continue;
 acs_back();
@@ -1069,6 +2000,47 @@ break;
 return 1;
 } // acs_endline
 
+int acs_column(void)
+{
+acs_pos_type save = tc;
+int colno = acs_startline();
+tc = save;
+return colno;
+} // acs_column
+
+int acs_moveline(int n)
+{
+acs_pos_type s, e;
+int colno, moved = 0;
+
+if(!(colno = acs_startline())) return 0;
+
+for(; n > 0; --n, ++moved) {
+s = tc;
+acs_endline();
+if(!acs_forward()) {
+tc = s;
+break;
+}
+}
+
+for(; n < 0; ++n, --moved) {
+if(!acs_back()) {
+acs_forward();
+break;
+}
+acs_startline();
+}
+
+/* same column, or the end of a shorter line */
+s = tc;
+acs_endline();
+e = tc;
+tc = s + colno - 1;
+if(tc > e) tc = e;
+return moved;
+} // acs_moveline
+
 // put the cursor back to a known location.
 // Internal use only.
 static void putback(int n)
@@ -1160,6 +2132,42 @@ if(!c) return 0;
 return 1;
 } // acs_endword
 
+int acs_moveword(int n)
+{
+acs_pos_type save;
+unsigned int c;
+int moved = 0;
+
+if(!acs_getc()) return 0;
+
+for(; n > 0; --n, ++moved) {
+save = tc;
+acs_endword();
+do {
+if(!acs_forward()) {
+tc = save;
+return moved;
+}
+c = acs_getc();
+} while(c == ' ' || c == '\n' || c == '\7');
+}
+
+for(; n < 0; ++n, --moved) {
+save = tc;
+acs_startword();
+do {
+if(!acs_back()) {
+tc = save;
+return moved;
+}
+c = acs_getc();
+} while(c == ' ' || c == '\n' || c == '\7');
+acs_startword();
+}
+
+return moved;
+} // acs_moveword
+
 void acs_startbuf(void)
 {
 tc = acs_mb->start;
@@ -1195,33 +2203,120 @@ done:
 	acs_back();
 } // acs_rspc
 
-/* Case insensitive match.  Assumes the first letters already match.
- * This is an ascii match on the unaccented letters. */
-static int stringmatch(const char *s)
+/* The folded shadow of the buffer being searched,
+ * one byte per character, as acs_unaccent gives it,
+ * for positions fold_from up to fold_to, with a null after.
+ * It is built when you search, and extended as text comes in.
+ * If the text underneath changes, the generation number tells us.
+ * The shadow can hold text that has since fallen off the back of the buffer;
+ * fold_lo is the start of the buffer, and searches go no further back. */
+static const struct acs_readingBuffer *fold_b;
+static unsigned int fold_gen;
+static acs_pos_type fold_from, fold_to, fold_lo;
+static unsigned char *fold_area;
+static size_t fold_room;
+
+#define FOLDAT(p) (fold_area + ((p) - fold_from))
+
+static int foldSync(const struct acs_readingBuffer *b)
 {
-	char x, y;
-	short count = 0;
+acs_pos_type p;
+size_t need;
+unsigned char *a;
+
+if(b != fold_b || b->gen != fold_gen ||
+b->start < fold_from || b->end < fold_to || fold_to < b->start) {
+/* start over */
+fold_b = b;
+fold_gen = b->gen;
+fold_from = fold_to = b->start;
+}
 
-	if(!(y = *++s)) return 1;
-	y = tolower(y);
+/* drop what has fallen off the back, if it is most of the shadow */
+if(b->start - fold_from > fold_to - b->start) {
+memmove(fold_area, FOLDAT(b->start), fold_to - b->start);
+fold_from = b->start;
+}
 
-	while(++count, acs_forward()) {
-		x = acs_unaccent(acs_getc());
-if(x != y) break;
-		if(!(y = (unsigned char)*++s)) return 1;
-y = tolower(y);
-	} /* while matches */
+need = b->end - fold_from + 1;
+if(need > fold_room) {
+need += need/4 + 1024;
+a = realloc(fold_area, need);
+if(!a) {
+fold_b = 0;
+errno = ENOMEM;
+return -1;
+}
+fold_area = a;
+fold_room = need;
+}
 
-	// put the cursor back
-	putback(-count);
-	return 0;
-} // stringmatch
+for(p=fold_to; p<b->end; ++p)
+*FOLDAT(p) = acs_unaccent(acs_bufchar(b, p));
+fold_to = b->end;
+*FOLDAT(fold_to) = 0;
+fold_lo = b->start;
+return 0;
+} // foldSync
 
-int acs_bufsearch(const char *string, int back, int newline)
+/* Text came off the end of the buffer; same as lineTrim() */
+static void foldTrim(const struct acs_readingBuffer *b)
+{
+if(b != fold_b || fold_gen + 1 != b->gen) return;
+fold_gen = b->gen;
+if(fold_to <= b->end) return;
+fold_to = b->end;
+*FOLDAT(fold_to) = 0;
+} // foldTrim
+
+/* Fold the search string the same way.  Returns its length, 0 if too long. */
+static unsigned char fold_pat[256];
+static int foldPattern(const char *s)
+{
+int m;
+for(m=0; s[m]; ++m) {
+if(m == sizeof(fold_pat)-1) return 0;
+fold_pat[m] = tolower((unsigned char)s[m]);
+}
+fold_pat[m] = 0;
+return m;
+} // foldPattern
+
+/* Find the folded pattern, of length m, starting at or after q.
+ * memchr finds candidates for the first letter a word at a time. */
+static acs_pos_type findForward(acs_pos_type q, int m)
 {
-	int ok;
-	unsigned int c, first;
+const unsigned char *s, *last = FOLDAT(fold_to - m);
+if(q < fold_lo) q = fold_lo;
+s = FOLDAT(q);
+while(s <= last) {
+s = memchr(s, fold_pat[0], last - s + 1);
+if(!s) break;
+if(!memcmp(s+1, fold_pat+1, m-1)) return fold_from + (s - fold_area);
+++s;
+}
+return 0;
+} // findForward
 
+/* Find the folded pattern starting at or before q. */
+static acs_pos_type findBack(acs_pos_type q, int m)
+{
+const unsigned char *s;
+const unsigned char *lo = FOLDAT(fold_lo);
+if(q > fold_to - m) q = fold_to - m;
+if(q < fold_lo) return 0;
+s = FOLDAT(q) + 1;
+while(s > lo) {
+s = memrchr(lo, fold_pat[0], s - lo);
+if(!s) break;
+if(!memcmp(s+1, fold_pat+1, m-1)) return fold_from + (s - fold_area);
+}
+return 0;
+} // findBack
+
+/* Position the temp cursor for a search, per the back and newline flags. */
+static int searchStart(int back, int newline)
+{
 if(acs_mb->end == acs_mb->start) return 0;
 if(!tc) return 0;
 
@@ -1229,21 +2324,136 @@ if(!tc) return 0;
 		if(back) acs_startline(); else acs_endline();
 	}
 
-	ok = back ? acs_back() : acs_forward();
-	if(!ok) return 0;
+	return back ? acs_back() : acs_forward();
+} // searchStart
 
-first = (unsigned char) *string;
-first = tolower(first);
+int acs_bufsearch(const char *string, int back, int newline)
+{
+	acs_pos_type p;
+	int m;
 
-	do {
-		c = acs_unaccent(acs_getc());
-if(c == first && stringmatch(string)) return 1;
-		ok = back ? acs_back() : acs_forward();
-	} while(ok);
+	if(!(m = foldPattern(string))) return 0;
+	if(!searchStart(back, newline)) return 0;
+	if(foldSync(acs_mb)) return 0;
 
-	return 0;
+	p = back ? findBack(tc, m) : findForward(tc, m);
+	if(!p) return 0;
+	tc = p + m - 1;
+	return 1;
 } // acs_bufsearch
 
+/* The last regular expression, compiled. */
+static char *re_source;
+static regex_t re_compiled;
+
+static int reCompile(const char *pattern)
+{
+if(re_source && stringEqual(re_source, pattern)) return 0;
+if(re_source) {
+regfree(&re_compiled);
+free(re_source);
+re_source = 0;
+}
+if(regcomp(&re_compiled, pattern, REG_EXTENDED|REG_ICASE|REG_NEWLINE)) {
+errno = EINVAL;
+return -1;
+}
+re_source = strdup(pattern);
+if(!re_source) {
+regfree(&re_compiled);
+errno = ENOMEM;
+return -1;
+}
+return 0;
+} // reCompile
+
+/* Run the expression over from up to to, in the shadow.
+ * A match has to start at or before limit, and have some length.
+ * Returns the first such match, or with last set, the last one. */
+static int reFind(acs_pos_type from, acs_pos_type to, acs_pos_type limit,
+int last, regmatch_t *found)
+{
+regmatch_t m;
+int flags, rc = 0;
+
+if(from < fold_lo) from = fold_lo;
+while(from <= limit && from < to) {
+m.rm_so = from - fold_from;
+m.rm_eo = to - fold_from;
+flags = REG_STARTEND;
+if(from > fold_lo && *FOLDAT(from-1) != '\n') flags |= REG_NOTBOL;
+if(regexec(&re_compiled, (char*)fold_area, 1, &m, flags)) break;
+if(fold_from + m.rm_so > limit) break;
+if(m.rm_eo > m.rm_so) {
+*found = m;
+rc = 1;
+if(!last) break;
+}
+from = fold_from + m.rm_so + 1;
+}
+
+return rc;
+} // reFind
+
+int acs_bufsearch_re(const char *pattern, int back, int newline)
+{
+	regmatch_t m;
+	acs_pos_type ls, le;
+	const unsigned char *u;
+
+	if(reCompile(pattern)) return 0;
+	if(!searchStart(back, newline)) return 0;
+	if(foldSync(acs_mb)) return 0;
+
+	if(!back) {
+		if(!reFind(tc, fold_to, fold_to, 0, &m)) return 0;
+	} else {
+		/* line by line, going back, the last match in each line */
+		le = tc;
+		if(le < fold_lo) return 0;
+		while(1) {
+			u = memrchr(FOLDAT(fold_lo), '\n', le - fold_lo);
+			ls = (u ? fold_from + (u - fold_area) + 1 : fold_lo);
+			u = memchr(FOLDAT(le), '\n', fold_to - le);
+			if(reFind(ls, (u ? fold_from + (u - fold_area) : fold_to), le, 1, &m)) break;
+			if(ls == fold_lo) return 0;
+			le = ls - 1;
+		}
+	}
+
+	tc = fold_from + m.rm_eo - 1;
+	return m.rm_eo - m.rm_so;
+} // acs_bufsearch_re
+
+int acs_bufsearch_all(const char *string, int regex, acs_pos_type *hits, int nhits)
+{
+	regmatch_t m;
+	acs_pos_type p;
+	int count = 0, len = 0;
+
+	if(regex) {
+		if(reCompile(string)) return -1;
+	} else {
+		if(!(len = foldPattern(string))) return 0;
+	}
+	if(foldSync(acs_mb)) return -1;
+
+	p = fold_lo;
+	while(1) {
+		if(regex) {
+			if(!reFind(p, fold_to, fold_to, 0, &m)) break;
+			p = fold_from + m.rm_so;
+		} else {
+			if(!(p = findForward(p, len))) break;
+		}
+		if(count < nhits) hits[count] = p;
+		++count;
+		++p;
+	}
+
+	return count;
+} // acs_bufsearch_all
+
 // inject chars into the stream
 int acs_injectstring(const char *s)
 {
@@ -1267,9 +2477,12 @@ static const char *lengthword[] = {
 	" cumprimento ",
 };
 
+/* Characters in the reading buffer, by position. */
+#define RBC(p) acs_bufchar(acs_rb, p)
+
 int acs_getsentence(unsigned int *dest, int destlen, acs_ofs_type *offsets, int prop)
 {
-const unsigned int *s;
+acs_pos_type s;
 unsigned int *t, *destend;
 acs_ofs_type *o;
 int j, l;
@@ -1300,7 +2513,7 @@ return 0;
 // zero offsets by default
 if(o) memset(o, 0, sizeof(acs_ofs_type)*destlen);
 
-while((c = *s) && t < destend) {
+while((c = RBC(s)) && t < destend) {
 if(c == '\n' && prop&ACS_GS_NLSPACE)
 c = ' ';
 
@@ -1349,8 +2562,9 @@ alnum = 1;
 continue;
 }
 
-if(c1 == '\'' && alnum && acs_isalpha(s[1])) {
+if(c1 == '\'' && alnum && acs_isalpha(RBC(s+1))) {
 const unsigned int *v;
+acs_pos_type w;
 char v0;
 /* this is treated as a letter, as in wouldn't,
  * unless there is another apostrophe before or after,
@@ -1361,8 +2575,8 @@ v0 = acs_unaccent(*v);
 if(v0 == '\'') goto punc;
 if(isdigit(v0)) goto punc;
 }
-for(v=s+1; acs_isalpha(*v); ++v)  ;
-v0 = acs_unaccent(*v);
+for(w=s+1; acs_isalpha(RBC(w)); ++w)  ;
+v0 = acs_unaccent(RBC(w));
 if(v0 == '\'') goto punc;
 if(isdigit(v0)) goto punc;
 // keep alnum alive
@@ -1379,10 +2593,10 @@ if(o) o[t-dest] = s-acs_rb->cursor;
 
 // check for repeat
 if(prop&ACS_GS_REPEAT &&
-c == s[1] &&
-c == s[2] &&
-c == s[3] &&
-c == s[4]) {
+c == RBC(s+1) &&
+c == RBC(s+2) &&
+c == RBC(s+3) &&
+c == RBC(s+4)) {
 char reptoken[60];
 const char *pname = acs_getpunc(c); /* punctuation name */
 if(pname) {
@@ -1393,7 +2607,7 @@ reptoken[0] = c1;
 reptoken[1] = 0;
 }
 strcat(reptoken, lengthword[acs_lang]);
-for(j=5; c == s[j]; ++j)  ;
+for(j=5; c == RBC(s+j); ++j)  ;
 sprintf(reptoken+strlen(reptoken), "%d", j);
 l = strlen(reptoken);
 if(t+l+2 > destend) break; // no room
@@ -69,12 +69,14 @@ rather than reimplementing the select logic yourself.
 *********************************************************************/
 
 extern int acs_fd; // file descriptor
+extern int acs_vcs_fd; // /dev/vcsa
 extern int acs_debug; // set to 1 for acs debugging
 /* This writes a message to the log if debugging is on */
 int acs_log(const char *msg, ...);
 
 // Returns the file descriptor, which is also stored in acs_fd.
-// Also opens /dev/vcsa, so you need permission for that.
+// Also opens /dev/vcsa, so you need permission for that,
+// and /dev/vcsu if it is there.
 int acs_open(const char *devname);
 
 // Free the AccessBridge, closing the associated device.
@@ -182,7 +184,8 @@ Section 3: the reading buffer.
 The reading buffer holds the text that you are going to read.
 In screen mode this is a copy of screen memory, also known as a screen snap.
 In line mode this is a log of recent tty output,
-the last 50,000 characters or so.
+the last 50,000 characters or so, and as much scrollback
+behind that as you ask for; see acs_scrollback below.
 either way it is guaranteed to be current and up to date
 when your keystroke handler is called.
 When you hit F2, I bring the reading buffer
@@ -190,8 +193,17 @@ up to date (if necessary), and call your keystroke handler with F2,
 whereupon you can commence reading or whatever F2 does.
 
 Characters are stored between start and end.
-*start and *end are null, and there are no null characters between.
+These, and the cursor and the marks, are not pointers but positions,
+64 bit offsets that count every character ever put in the buffer.
+They only go up, so a position stays valid as new text comes in;
+the log just slides forward, without copying anything,
+and the oldest text falls off the back.
+The text lives in a ring, area[], at position & (ringsize-1),
+so don't index area[] yourself; call acs_bufchar(),
+which returns 0 for any position outside start and end.
+There are no null characters between start and end.
 If start == end then the buffer is empty.
+Position 0 is never used, so a cursor or mark of 0 means none.
 This is impossible in screen mode; there are always 25 rows
 and 80 columns of something.  Even blank spaces.
 (This is standard; larger screens are possible.)
@@ -204,13 +216,14 @@ Or let me do it for you via index markers.  See section 11.
 The text should probably be treated as readonly.
 
 If lots of tty output pushes your cursor off the back of the buffer,
+scrollback included,
 it will be left as null.
 Example: cat a large file.
 So be sure to check for null at the top of your event handler.
 You may, upon this condition,
 stop reading, or sound a buzz, or speak a quick overflow message, or whatever.
 
-marks[] is an array of pointers into the tty buffer.
+marks[] is an array of positions into the tty buffer.
 You can set and read these as you wish.
 I move these along with the text, just like the cursor.
 Thus you can set locations in your buffer and jump back to them as needed.
@@ -243,7 +256,9 @@ The acs_getsentence routine passes a sentence back, again in unicode.
 Or you can tap into the buffer yourself if you like.
 
 This almost works in screen mode.
-A codepage converts the bytes in screen memory into unicode,
+If the kernel has /dev/vcsu, 4.19 and later,
+the screen is read from there, in unicode, and all is well.
+Otherwise a codepage converts the bytes in screen memory into unicode,
 but the conversion is not 100% faithful.
 It is optimized for the letters of your language, but there is some ambiguity.
 On my system, cp437, the Germsn s-zet is the same as the greek beta.
@@ -253,16 +268,33 @@ Speakup has the same problem; it is intrinsic to Linux.
 This is just one more reason you should run in line mode whenever possible.
 *********************************************************************/
 
-/* linear log buffer, has to be between 30K and 64K */
+/* log buffer in the ring, has to be between 30K and 64K */
 #define TTYLOGSIZE 50000
+/* the largest ring that holds it, a power of 2 */
+#define TTYLOGRING 65536
+
+typedef long long acs_pos_type;
+
+struct acs_scrollback;
+struct acs_lineindex;
 
 struct acs_readingBuffer {
-	unsigned int area[TTYLOGSIZE + 2];
+	unsigned int *area;
+	int ringsize; // a power of 2, up to TTYLOGRING
+	unsigned char *packed; // the ring, packed, while the console is idle
+	int packedlen;
+	long lastuse; // when text last came in, or this was the foreground
+	unsigned char pp_state; // postprocessor state, between chunks of output
+	unsigned short pp_len; // how far into an escape sequence
+	unsigned int gen; // bumped when text already in the buffer is changed
 	unsigned char *attribs;
-	unsigned int *start, *end;
-	unsigned int *cursor;
-	unsigned int *v_cursor;
-	unsigned int *marks[27+1];
+	acs_pos_type start, end;
+	acs_pos_type hot; // where the ring starts; before this is scrollback
+	struct acs_scrollback *cold;
+	struct acs_lineindex *lines; // where the newlines are, once you move by lines
+	acs_pos_type cursor;
+	acs_pos_type v_cursor;
+	acs_pos_type marks[27+1];
 };
 
 /*********************************************************************
@@ -274,10 +306,91 @@ I would declare these const, but you have to be able to update the cursor.
 
 extern struct acs_readingBuffer *acs_mb, *acs_rb, *acs_tb;
 
+/*********************************************************************
+The character at a position in a buffer, or 0 if the position
+is before the start or at or after the end.
+*********************************************************************/
+
+unsigned int acs_bufchar(const struct acs_readingBuffer *b, acs_pos_type pos);
+
+/*********************************************************************
+The text of a buffer from one position up to, but not including, another,
+in utf8.  This allocates; free it when you are done.
+*********************************************************************/
+
+unsigned char *acs_buf2utf8(const struct acs_readingBuffer *b,
+acs_pos_type from, acs_pos_type to);
+
+/*********************************************************************
+Scrollback.
+Only the last TTYLOGSIZE characters of a tty log live in the ring, area[],
+from hot to end.
+Text that slides off the back of the ring can be kept, in line mode,
+as scrollback, so start can be far behind hot.
+Set acs_scrollback to the number of characters to keep, per console,
+behind the ring; 0, the default, keeps none.
+The scrollback is stored in segments, and all but the newest are packed,
+about a byte per character for ordinary tty output,
+so ten million characters of history costs about ten megabytes per console.
+acs_bufchar(), the cursor commands, search, and acs_getsentence
+all run back through the scrollback as though it were one buffer.
+Reading backwards through it is slower than the ring,
+because a segment has to be unpacked when you step into it.
+
+acs_scrollpush, acs_scrollchar, and acs_scrollfree are used by the bridge
+to move text into the scrollback, read it, and throw it away.
+You shouldn't have to call them yourself.
+*********************************************************************/
+
+extern long acs_scrollback;
+
+acs_pos_type acs_scrollpush(struct acs_readingBuffer *b,
+acs_pos_type pos, const unsigned int *s, int n);
+unsigned int acs_scrollchar(const struct acs_readingBuffer *b, acs_pos_type pos);
+void acs_scrollfree(struct acs_readingBuffer *b);
+long acs_scrollbytes(const struct acs_readingBuffer *b);
+
+/*********************************************************************
+Memory.
+A tty log is only allocated when its console first comes to the foreground,
+or has output that we catch up on in the background,
+and its ring starts at a few K and doubles as text comes in,
+up to TTYLOGRING.  A console that only ever shows a login prompt
+stays small.
+A background console whose log has not changed for acs_idle_compact seconds
+has its ring packed, about a byte per character, and the ring is freed.
+It is inflated again, without your having to do anything,
+when you switch to that console or new output arrives for it.
+The default is ten minutes; 0 never packs a ring.
+This is checked as events come in, at most once every few seconds.
+
+acs_memstats fills in a snapshot of what the bridge is holding,
+so you can see what this is saving you.
+
+acs_loggrow, acs_logcompact, and acs_loginflate are used by the bridge
+to manage the rings; you shouldn't have to call them yourself.
+*********************************************************************/
+
+extern int acs_idle_compact;
+
+struct acs_memstats {
+	int logs; // tty logs allocated
+	int packed; // of those, how many are packed while idle
+	long ringbytes; // bytes in the rings
+	long packedbytes; // bytes of packed, idle rings
+	long scrollbytes; // bytes of scrollback
+};
+
+void acs_memstats(struct acs_memstats *m);
+
+int acs_loggrow(struct acs_readingBuffer *b, int need);
+int acs_logcompact(struct acs_readingBuffer *b);
+int acs_loginflate(struct acs_readingBuffer *b);
+
 /*********************************************************************
 Within screen mode, attribs is an array holding the attributes of each character on screen.
 Underline, inverse, blinking, etc.
-The attribute of the character pointed to by s is acs_mb->attribs[s-acs_mb->start];
+The attribute of the character at position s is acs_mb->attribs[s-acs_mb->start];
 No, I don't know what any of the bits mean; guess we'll have to look them up in linux documentation.
 A normal character is 7.
 *********************************************************************/
@@ -295,6 +408,15 @@ CRLF - Turn cr lf into lf.
 Other - removes other control characters.
 ESCB - Remove the ansi escape codes that move the cursor, set attributes, etc.
 These are not text, and can be confusing if mixed into the tty log.
+That is escape [ sequences, escape ] strings such as the window title,
+the other strings, dcs sos pm apc, that run up to escape \ ,
+charset designators such as escape ( B, and escape with one character.
+
+Each character is looked at once, as it arrives, before it goes into the buffer.
+Each console remembers where it is in an escape sequence,
+so a sequence that is split across two reads is still removed.
+Backspace and cr lf can reach back into text that is already in the buffer,
+but not into scrollback.
 *********************************************************************/
 
 #define ACS_PP_CTRL_H 0x1
@@ -329,6 +451,21 @@ that I have set aside for it.
 
 int acs_screenmode(int enabled);
 
+/*********************************************************************
+The kernel keeps its own log of each console, 64K of utf8 by default.
+This is where the catch up comes from,
+so it needs to hold whatever might come out between your refreshes.
+A build server that spews megabytes wants a deeper log;
+a small embedded box might get by with 8K.
+Set the size in bytes, which is rounded up to a power of 2,
+from a page to 16 megabytes.
+Minor is the console, 1 through 63, or 0 for all consoles,
+including those yet to be opened.
+The text is kept as the log is resized, as much of it as fits.
+*********************************************************************/
+
+int acs_ringsize(int minor, int size);
+
 /*********************************************************************
 Notify the adapter when more characters have been posted to the tty
 since your last keystroke or refresh command.
@@ -416,6 +553,20 @@ int acs_setkey(int key, int shiftstate);
 int acs_unsetkey(int key, int shiftstate);
 int acs_clearkeys(void); /* clear all keys */
 
+/*********************************************************************
+Each of the above is a write to the driver,
+and reloading a configuration file can be hundreds of them.
+Meanwhile the user could strike a key that is half configured.
+Put acs_batchkeys(1) before a series of key changes,
+and acs_batchkeys(0) after,
+and the bridge keeps track of the changes and sends down the whole
+keymap in one write, which the driver swaps in all at once.
+Batches nest; the keymap goes down when the outermost one ends.
+acs_suspendkeys() and acs_resumekeys() batch their changes for you.
+*********************************************************************/
+
+int acs_batchkeys(int enabled);
+
 /* Called when the bridge supplies us with a keystroke. */
 typedef void (*key_handler_t) (int key, int shiftstate, int leds);
 extern key_handler_t acs_key_h;
@@ -431,10 +582,72 @@ That will bring in your keystroke events.
 It's probably best to just remember the last keystroke event,
 i.e. the last speech command issued,
 and act on that, in case the user has typed ahead of the adapter.
+acs_fd is always ready to write, so it can sit in the same epoll set
+as the synthesizer and your timers.
+The driver wakes you when an event lands in an empty queue,
+not on every event, so edge triggered epoll works
+as long as you call acs_events() each time you are woken,
+and make acs_fd nonblocking.
+Then acs_events() reads until the queue is empty.
+On a blocking fd it reads once, and anything left behind,
+or anything that came in during the read, brings no new wakeup.
 *********************************************************************/
 
 int acs_events(void);
 
+/*********************************************************************
+Or let the driver send you SIGIO whenever there is an event to read.
+Your signal handler should only set a flag;
+call acs_events() from the main loop, as always.
+Pass 0 to turn it off.
+*********************************************************************/
+
+int acs_async(int enabled);
+
+/*********************************************************************
+The driver queues events until you read them.
+If you fall behind, and the queue fills up, new events are dropped.
+The driver tells you how many, and the count accumulates here.
+The text buffer is always brought up to date when this happens,
+but a keystroke could have been lost.
+If this number is not zero, load acsint with a larger rbufsize.
+The bridge asks the driver to number its events,
+so the count is the gaps in the numbers;
+events superseded by a console switch are not counted.
+*********************************************************************/
+
+extern unsigned int acs_dropped;
+
+/*********************************************************************
+The number of bytes of tty text that the driver lost before we could read it,
+because the text ran out the back of its log,
+or because a catch up was trimmed to fit our buffer.
+Characters we read but had no memory to keep are counted here too.
+Each catch up says where it starts in the driver's log,
+so the bridge can tell whether any text went missing without notice.
+If so, it asks the driver to send that console's text again,
+from where the last catch up left off.
+If this number keeps growing, load acsint with a larger ringsize,
+or call acs_bg_refresh() more often.
+*********************************************************************/
+
+extern unsigned int acs_overrun;
+
+/*********************************************************************
+Ask the driver to put the time on each event.
+The time is in nanoseconds, from the monotonic clock,
+the same as clock_gettime(CLOCK_MONOTONIC),
+and it is set here before your handler is called.
+For a keystroke, that is when the key was struck;
+for new text, when the last of that text was written to the tty.
+Compare it with the clock when the synthesizer starts speaking,
+and you have the latency from keystroke to speech.
+Off by default, and 0 when off.
+*********************************************************************/
+
+extern unsigned long long acs_event_ns;
+int acs_timestamps(int enabled);
+
 /*********************************************************************
 Declare that a key is a meta key.
 For example, Speakup uses the insert key to modify other keys.
@@ -477,10 +690,28 @@ The user automatically hears any new text that is generated.
 
 You do not need to call this on keystrokes;
 the buffer is automatically brought up to date.
+
+If the driver lets us map its tty logs, and most do,
+the new text is pulled directly from the kernel's ring,
+and this returns at once, without a system call, if there is nothing new.
 *********************************************************************/
 
 int acs_refresh(void);
 
+/*********************************************************************
+Bring the background consoles up to date.
+The driver only catches up the foreground console on its own,
+so text that scrolls past on another console waits in the kernel,
+and comes down all at once when you switch to it.
+Call this when you are idle, and the switch will be instant.
+It visits every console with new text, through pread() on the device,
+or through the mapped rings, which costs nothing if there is nothing new.
+Consoles you have never visited are included if the rings are mapped.
+No handlers are called.
+*********************************************************************/
+
+int acs_bg_refresh(void);
+
 
 /*********************************************************************
 Section 5: key redirection.
@@ -964,9 +1195,22 @@ int acs_back(void);
 // Start and end of line.
 // Can only fail if the buffer is empty.
 // Start line returns the column number.
+// The first time you use these, the bridge indexes the newlines
+// in the buffer, and keeps the index as text comes in,
+// so finding the start or end of a line is quick, however long it is.
 int acs_startline(void);
 int acs_endline(void);
 
+// The column number, without moving the cursor.
+int acs_column(void);
+
+/* Move n lines down, or up if n is negative, staying in the same column,
+ * or on the last character of a shorter line.
+ * This stops at the top or bottom of the buffer, and returns the number
+ * of lines it actually moved, so a key that is held down and repeats
+ * won't take the cursor out of the buffer. */
+int acs_moveline(int n);
+
 /*********************************************************************
 Start and end of word.  But word is more like a token.
 don't is a word, even though it contains an apostrophe.
@@ -984,6 +1228,12 @@ as long as your $LANG reflects your desired language.
 int acs_startword(void);
 int acs_endword(void);
 
+/* Move to the start of the nth next word, or the nth previous word
+ * if n is negative, skipping spaces and newlines.
+ * As above, this stops at either end of the buffer,
+ * and returns the number of words moved. */
+int acs_moveword(int n);
+
 // start and end of buffer
 void acs_startbuf(void);
 void acs_endbuf(void);
@@ -994,15 +1244,32 @@ void acs_rspc(void);
 
 /*********************************************************************
 Search for a string in the buffer.
-The search is case inssensitive.
-Upper and lower case letters are determined by the current locale,
-so could be set to work in Spanish, French, etc.
+The search is case inssensitive, and ignores accents;
+the string is matched against the buffer as acs_unaccent() sees it.
 The second parameter causes the search to run backward or forward.
 The third parameter causes the search to begin on the previous or next line.
 Return 1 if the string is found,
-whereupon the temp cursor points to the start of the string.
+whereupon the temp cursor points to the last character of the string.
+
+The bridge keeps a folded copy of the buffer for searching,
+one byte per character, built the first time you search
+and extended as text comes in, so repeated searches,
+even through a lot of scrollback, are quick.
+
+acs_bufsearch_re() is the same, with an extended regular expression,
+case insensitive, that does not match across lines.
+It returns the length of the match, or 0 if there is none,
+and again leaves the temp cursor on the last character of the match.
+
+acs_bufsearch_all() finds every match of a string, or a regular expression
+if regex is nonzero, from the start of the buffer to the end.
+The positions where the matches start are stored in hits[],
+up to nhits of them, and the return is the number of matches,
+which could be more than nhits.  The cursor does not move.
 *********************************************************************/
 int acs_bufsearch(const char *string, int back, int newline);
+int acs_bufsearch_re(const char *pattern, int back, int newline);
+int acs_bufsearch_all(const char *string, int regex, acs_pos_type *hits, int nhits);
 
 
 /*********************************************************************
@@ -1038,8 +1305,8 @@ this is for the aforementioned story, where newlines mean nothing.
 This is incompatible with ACS_GS_ONEWORD or ACS_GS_STOPLINE.
 
 Don't use this function to read a single character.
-Just grab acs_mb->cursor[0], or call acs_getc().
-The latter is preferable for purposes of encapsulation.
+Just call acs_getc(), or acs_bufchar(acs_mb, acs_mb->cursor).
+The former is preferable for purposes of encapsulation.
 This routine has too much overhead for just one character,
 and it does some translations that you may or may not want.
 
@@ -1103,16 +1370,15 @@ and where they are located relative to the reading cursor.
 The last offset, corresponding to the null byte in the sentence array,
 is the length of the text consumed, or the offset of the next chunk to read once this one is finished.
 
-Unsigned short is sufficient to represent an offset, since the entire
-tty buffer cannot be larger than 64K.
-Not that you'd ever want to read a sentence that long anyways.
 You'd almost think unsigned char is sufficient, a sentence of length 256,
 but the sentence may include a thousand dashes, which are compressed down
 to a single token, and so the word after those dashes has index 1043.
-I'm going with unsigned short just to be safe.
+This used to be unsigned short, when the tty buffer could not be larger
+than 64K, but with scrollback a run of repeated characters
+can be longer than that, so an offset is 32 bits.
 *********************************************************************/
 
-typedef unsigned short acs_ofs_type;
+typedef unsigned int acs_ofs_type;
 
 int acs_getsentence(unsigned int *dest, int destlen,
 		acs_ofs_type *offsets, int properties);
@@ -1145,7 +1411,7 @@ extern int acs_sy_fd0, acs_sy_fd1; /* file descriptors */
 /* Which index marker has been returned to us, example 2 out of 5 */
 typedef void (*acs_imark_handler_t)(int mark, int lastmark);
 extern acs_imark_handler_t acs_imark_h;
-extern unsigned int *acs_imark_start; /* for internal bookkeeping */
+extern acs_pos_type acs_imark_start; /* for internal bookkeeping */
 
 /* External serial synthesizer, typically /dev/ttySn
  * baud must be one of the standard baud rates from 1200 to 115200
@@ -1185,8 +1451,11 @@ extern int acs_pipe_broken;
 Wait for communication from either the acsint kernel module or the synthesizer.
 The return is 1 if acs_fd has data,
 2 if acs_sy_fd0 has data,
-and 4 if the acsint fifo has an incoming message.
+4 if the acsint fifo has an incoming message,
+and 8 if the screen has changed, when acs_screen_h is set.
 (See section 14 for interprocess messages.)
+While output to the synth is queued, this also waits for the synth
+to take more, and sends it; that is not reported to you.
 *********************************************************************/
 
 int acs_wait(void);
@@ -1336,6 +1605,44 @@ void acs_say_string(const char *s);
 void acs_say_string_n(const char *s);
 void acs_say_string_uc(const unsigned int *s);
 
+/*********************************************************************
+Each of these, and acs_say_indexed() below, puts the whole utterance
+together, text, index markers, and the closing return,
+and sends it to the synth in one write.
+That is one burst over a serial line, rather than a burst for every word.
+
+Nothing here blocks.  The bridge makes acs_sy_fd1 nonblocking,
+and if the synth won't take the text, because a serial unit dropped CTS,
+or a software synth isn't reading its pipe, the text is queued,
+and acs_wait() sends the rest as the synth is ready for it.
+So the adapter keeps reading keys, even if the synth is stuck.
+The queue has lanes, highest priority first:
+the interrupt from acs_shutup(), control strings such as volume and pitch,
+echo, which is everything sent by the functions above,
+and reading, from acs_say_indexed().
+acs_shutup() drops the echo and reading lanes, however long they are,
+in one step, then sends the interrupt ahead of everything else,
+save a control string that is partly sent, which is finished first.
+If the bridge runs out of memory for the queue,
+the new text is dropped, and a line goes to the log.
+
+acs_sy_pending() is nonzero if text is still queued.
+acs_sy_flush() sends what it can, without blocking.
+You don't normally need it, but call it before you write to acs_sy_fd1
+yourself, and check acs_sy_pending(), so the bytes go out in order.
+*********************************************************************/
+
+enum acs_sy_lane {
+ACS_SY_LANE_INTERRUPT,
+ACS_SY_LANE_CONTROL,
+ACS_SY_LANE_ECHO,
+ACS_SY_LANE_READING,
+ACS_SY_LANES
+};
+
+int acs_sy_pending(void);
+void acs_sy_flush(void);
+
 /*********************************************************************
 Send a string to the synth, but include an index marker for each
 nonzero entry in offsets[].
@@ -1471,14 +1778,27 @@ Bringing in a new language is terribly nasty!
 It's not centralized in one place.
 You have to grep for acs_lang and see wherever it is used.
 Then add new words or cases or code for the new language.
+At least the letters are in one place, mkuctab.c,
+which builds the tables these functions use.
+Each one is a lookup, whatever the character,
+in the tables for acs_lang, chosen when acs_lang changes.
 *********************************************************************/
 
 int acs_unilen(const unsigned int *u); // like strlen but for unicodes
 unsigned char *acs_uni2utf8(const unsigned int *unicode_buf); // allocates
 int acs_utf82uni(const unsigned char *utf8_buf, unsigned int *dest);
+/* Convert n characters, or up to the null if n is negative,
+ * into a buffer of your own with room for room bytes or unicodes.
+ * Like snprintf, these return the length of the whole conversion,
+ * not counting the null, and write as much as fits, with a null after.
+ * So call with room 0 to find out how much room you need.
+ * The utf8 should end on a character boundary.
+ * Nothing is allocated, and there is no static state. */
+int acs_uni2utf8_buf(const unsigned int *s, int n, unsigned char *t, int room);
+int acs_utf82uni_buf(const unsigned char *s, int n, unsigned int *t, int room);
 // First argument lower utf8, second argument unicode
 int acs_substring_mix(const char *s, const unsigned int *t);
-// convert to utf8 then write to a file
+// convert to utf8 then write to a file, in one write
 void acs_write_mix(int fd, const unsigned int *s, int len);
 
 int acs_isalpha(unsigned int uc);
@@ -1494,11 +1814,45 @@ unsigned int acs_toupper(unsigned int uc);
 // from u umlaut to u
 char acs_unaccent(unsigned int uc);
 
+/* The tables, generated by mkuctab; see that file for the layout. */
+#define ACS_UC_ALPHA 1
+#define ACS_UC_DIGIT 2
+#define ACS_UC_SPACE 4
+#define ACS_UC_VOWEL 8
+extern const unsigned char acs_uc_index[][256];
+extern const unsigned short acs_uc_blocks[][256];
+
 /* visual cursor coordinates, based at 0,0 */
 extern int acs_vc_nrows, acs_vc_ncols;
 extern int acs_vc_row, acs_vc_col;
 void acs_vc(void);
+/* Bring the screen buffer up to date.  Only the rows that have changed
+ * since the last snapshot are rebuilt. */
 void acs_screensnap(void);
 
+/*********************************************************************
+Screen changes.
+The kernel can tell us when the foreground console changes,
+its contents or its cursor, through poll on /dev/vcsa.
+It shows up as an exceptional condition, POLLPRI, on acs_vcs_fd,
+and stays that way until the screen is read.
+Set acs_screen_h and acs_wait() watches acs_vcs_fd as well,
+and returns 8 when the screen has changed.
+acs_all_events() then calls acs_screen_events(),
+which reads the cursor position, leaving it in acs_vc_row and acs_vc_col,
+and calls your handler with the same.
+So a screen mode adapter doesn't have to call acs_vc() to see where
+the cursor is; it is always current.
+If you run your own select loop, put acs_vcs_fd in the exception set,
+and call acs_screen_events() when it fires.
+Leave acs_screen_h 0 in line mode; there is no point waking up twice
+for every bit of output.
+*********************************************************************/
+
+typedef void (*acs_screen_handler_t)(int row, int col);
+extern acs_screen_handler_t acs_screen_h;
+
+int acs_screen_events(void);
+
 
 #endif
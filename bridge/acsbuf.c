@@ -0,0 +1,332 @@
+/*********************************************************************
+File: acsbuf.c
+Description: scrollback for the tty reading buffers.
+Text that slides off the back of a buffer's ring is kept here,
+in segments of SEGSIZE characters.
+The newest segment is open, plain unicode, and still filling up.
+Older segments are packed, utf8 with runs of the same character
+squeezed down, which is about one byte per character for a typical tty.
+The oldest segments are thrown away once acs_scrollback is reached.
+The ring itself lives here too.  It starts small and grows as text
+comes in, and the ring of a console that has been idle a while
+is packed the same way and inflated again when it is needed.
+*********************************************************************/
+
+#include <stdlib.h>
+#include <string.h>
+#include <malloc.h>
+
+#include "acsbridge.h"
+
+/* characters per segment */
+#define SEGSIZE 16384
+/* a run this long or longer is packed as a count and one character */
+#define MINRUN 4
+/* smallest ring */
+#define RINGMIN 1024
+
+long acs_scrollback; // characters of history to keep behind each ring
+
+struct coldseg {
+	struct coldseg *next; // the next newer segment
+	acs_pos_type pos; // position of the first character
+	int len; // bytes of packed data
+	unsigned char data[0];
+};
+
+struct acs_scrollback {
+	struct coldseg *first, *last; // oldest and newest packed segments
+	acs_pos_type pos; // position of open[0]
+	int nopen; // characters in the open segment
+	unsigned int open[SEGSIZE];
+};
+
+/* The last segment unpacked, so reading along doesn't unpack it every time.
+ * There is only one, for all the consoles; you read one at a time. */
+static const struct acs_scrollback *cache_sb;
+static const struct coldseg *cache_seg;
+static unsigned int cache[SEGSIZE];
+
+static unsigned char *put_utf8(unsigned char *t, unsigned int c)
+{
+	int n, j;
+	if(c <= 0x7f) {
+		*t++ = c;
+		return t;
+	}
+	if(c <= 0x7ff) *t = 0xc0, n = 1;
+	else if(c <= 0xffff) *t = 0xe0, n = 2;
+	else if(c <= 0x1fffff) *t = 0xf0, n = 3;
+	else if(c <= 0x3ffffff) *t = 0xf8, n = 4;
+	else *t = 0xfc, n = 5;
+	*t++ |= c >> (6*n);
+	for(j=n-1; j>=0; --j)
+		*t++ = 0x80 | ((c >> (6*j)) & 0x3f);
+	return t;
+} /* put_utf8 */
+
+static const unsigned char *get_utf8(const unsigned char *s, unsigned int *cp)
+{
+	unsigned int c = *s++;
+	unsigned char mask = 0x40;
+	int n = 0;
+	if(c & 0x80) {
+		while(c & mask) ++n, mask >>= 1;
+		c &= mask - 1;
+		while(n--)
+			c = (c << 6) | (*s++ & 0x3f);
+	}
+	*cp = c;
+	return s;
+} /* get_utf8 */
+
+static void freeSegments(struct acs_scrollback *sb)
+{
+	struct coldseg *seg;
+	while((seg = sb->first)) {
+		sb->first = seg->next;
+		if(seg == cache_seg) cache_seg = 0;
+		free(seg);
+	}
+	sb->last = 0;
+} /* freeSegments */
+
+/* Pack n characters at t, which has room for 6 bytes per character.
+ * Returns the end of the packed data. */
+static unsigned char *pack(const unsigned int *s, int n, unsigned char *t)
+{
+	const unsigned int *end = s + n;
+	int run;
+
+	while(s < end) {
+		for(run=1; s+run < end && s[run] == s[0] && run < 255; ++run)  ;
+		if(run >= MINRUN || !s[0]) {
+			/* zero is never the start of a utf8 character,
+			 * so it introduces a run, which also covers a null in the text. */
+			*t++ = 0;
+			*t++ = run;
+		} else run = 1;
+		t = put_utf8(t, *s);
+		s += run;
+	}
+	return t;
+} /* pack */
+
+/* Unpack into a ring, or a flat array if mask covers it, from position p. */
+static void unpack(const unsigned char *s, int len,
+unsigned int *area, int mask, acs_pos_type p)
+{
+	const unsigned char *end = s + len;
+	unsigned int c;
+	int run;
+
+	while(s < end) {
+		run = 1;
+		if(!*s) {
+			run = s[1];
+			s += 2;
+		}
+		s = get_utf8(s, &c);
+		while(run--) area[p++ & mask] = c;
+	}
+} /* unpack */
+
+/* Pack the open segment and put it on the end of the list.
+ * Every packed segment holds exactly SEGSIZE characters.
+ * If we can't get the memory, the history starts over after this segment;
+ * there can't be a hole in the middle. */
+static void closeSegment(struct acs_scrollback *sb)
+{
+	struct coldseg *seg, *shrunk;
+	unsigned char *t;
+
+	seg = malloc(sizeof(struct coldseg) + sb->nopen*6);
+	if(seg) {
+		t = pack(sb->open, sb->nopen, seg->data);
+		seg->len = t - seg->data;
+		shrunk = realloc(seg, sizeof(struct coldseg) + seg->len);
+		if(shrunk) seg = shrunk;
+		seg->next = 0;
+		seg->pos = sb->pos;
+		if(sb->last) sb->last->next = seg;
+		else sb->first = seg;
+		sb->last = seg;
+	} else freeSegments(sb);
+
+	sb->pos += sb->nopen;
+	sb->nopen = 0;
+} /* closeSegment */
+
+static void unpackSegment(const struct acs_scrollback *sb, const struct coldseg *seg)
+{
+	unpack(seg->data, seg->len, cache, SEGSIZE-1, 0);
+	cache_sb = sb;
+	cache_seg = seg;
+} /* unpackSegment */
+
+/* Drop segments that are entirely older than we want to keep. */
+static void trim(struct acs_scrollback *sb, acs_pos_type oldest)
+{
+	struct coldseg *seg;
+	while((seg = sb->first)) {
+		if(seg->pos + SEGSIZE > oldest) break;
+		sb->first = seg->next;
+		if(!sb->first) sb->last = 0;
+		if(seg == cache_seg) cache_seg = 0;
+		free(seg);
+	}
+} /* trim */
+
+acs_pos_type acs_scrollpush(struct acs_readingBuffer *b,
+acs_pos_type pos, const unsigned int *s, int n)
+{
+	struct acs_scrollback *sb = b->cold;
+	acs_pos_type oldest;
+	int k;
+
+	if(acs_scrollback <= 0) {
+		acs_scrollfree(b);
+		return pos + n;
+	}
+
+	if(!sb) {
+		sb = malloc(sizeof(struct acs_scrollback));
+		if(!sb) return pos + n;
+		sb->first = sb->last = 0;
+		sb->nopen = 0;
+		sb->pos = pos;
+		b->cold = sb;
+	}
+
+	if(sb->pos + sb->nopen != pos) {
+		/* not contiguous; should never happen. Start over. */
+		acs_scrollfree(b);
+		return acs_scrollpush(b, pos, s, n);
+	}
+
+	while(n) {
+		k = SEGSIZE - sb->nopen;
+		if(k > n) k = n;
+		memcpy(sb->open + sb->nopen, s, k*4);
+		sb->nopen += k;
+		s += k, n -= k;
+		if(sb->nopen == SEGSIZE) closeSegment(sb);
+	}
+
+	oldest = sb->pos + sb->nopen - acs_scrollback;
+	trim(sb, oldest);
+	if(sb->first && sb->first->pos > oldest) oldest = sb->first->pos;
+	if(!sb->first && sb->pos > oldest) oldest = sb->pos;
+	return oldest;
+} /* acs_scrollpush */
+
+unsigned int acs_scrollchar(const struct acs_readingBuffer *b, acs_pos_type pos)
+{
+	const struct acs_scrollback *sb = b->cold;
+	const struct coldseg *seg;
+
+	if(!sb) return 0;
+	if(pos >= sb->pos) {
+		if(pos >= sb->pos + sb->nopen) return 0;
+		return sb->open[pos - sb->pos];
+	}
+
+	seg = cache_seg;
+	if(seg && cache_sb == sb &&
+	pos >= seg->pos && pos < seg->pos + SEGSIZE)
+		goto found;
+
+	for(seg=sb->first; seg; seg=seg->next) {
+		if(pos < seg->pos) return 0;
+		if(pos < seg->pos + SEGSIZE) break;
+	}
+	if(!seg) return 0;
+	unpackSegment(sb, seg);
+
+found:
+	return cache[pos - seg->pos];
+} /* acs_scrollchar */
+
+void acs_scrollfree(struct acs_readingBuffer *b)
+{
+	struct acs_scrollback *sb = b->cold;
+	if(!sb) return;
+	freeSegments(sb);
+	free(sb);
+	b->cold = 0;
+} /* acs_scrollfree */
+
+long acs_scrollbytes(const struct acs_readingBuffer *b)
+{
+	const struct acs_scrollback *sb = b->cold;
+	const struct coldseg *seg;
+	long n;
+	if(!sb) return 0;
+	n = sizeof(struct acs_scrollback);
+	for(seg=sb->first; seg; seg=seg->next)
+		n += sizeof(struct coldseg) + seg->len;
+	return n;
+} /* acs_scrollbytes */
+
+int acs_loggrow(struct acs_readingBuffer *b, int need)
+{
+	unsigned int *a;
+	int size;
+	acs_pos_type p;
+
+	if(need > TTYLOGRING) need = TTYLOGRING;
+	if(b->ringsize >= need) return b->ringsize;
+	for(size=RINGMIN; size<need; size<<=1)  ;
+	a = malloc(size*4);
+	if(!a) return b->ringsize;
+	/* the text sits at a different place in a ring of a different size */
+	if(b->area)
+	for(p=b->hot; p<b->end; ++p)
+		a[p & (size-1)] = b->area[p & (b->ringsize-1)];
+	free(b->area);
+	b->area = a;
+	b->ringsize = size;
+	return size;
+} /* acs_loggrow */
+
+int acs_logcompact(struct acs_readingBuffer *b)
+{
+	acs_pos_type p, stop;
+	unsigned char *t, *shrunk;
+	int j;
+
+	if(!b->area || b->packed) return 0;
+	if(b->end > b->hot) {
+		t = malloc((b->end - b->hot) * 6);
+		if(!t) return -1;
+		b->packed = t;
+		/* the ring may wrap, so in two pieces at most */
+		for(p=b->hot; p<b->end; p=stop) {
+			j = b->ringsize - (p & (b->ringsize-1));
+			stop = p + j;
+			if(stop > b->end) stop = b->end;
+			t = pack(b->area + (p & (b->ringsize-1)), stop - p, t);
+		}
+		b->packedlen = t - b->packed;
+		shrunk = realloc(b->packed, b->packedlen);
+		if(shrunk) b->packed = shrunk;
+	}
+	free(b->area);
+	b->area = 0;
+	b->ringsize = 0;
+	return 0;
+} /* acs_logcompact */
+
+int acs_loginflate(struct acs_readingBuffer *b)
+{
+	if(b->area) return 0;
+	if(acs_loggrow(b, b->end - b->hot) < b->end - b->hot)
+		return -1;
+	if(b->packed) {
+		unpack(b->packed, b->packedlen, b->area, b->ringsize-1, b->hot);
+		free(b->packed);
+		b->packed = 0;
+		b->packedlen = 0;
+	}
+	return 0;
+} /* acs_loginflate */
@@ -69,15 +69,184 @@ acs_imark_handler_t acs_imark_h;
 /* send return to the synth - start speaking */
 static const char kbyte = '\13';
 static const char crbyte = '\r';
+
+/* Output to the synth is queued, and written without blocking,
+ * as fast as the synth will take it.
+ * If a serial unit drops CTS, or a software synth stops reading its pipe,
+ * the text waits here, and acs_wait() sends the rest when it can.
+ * Each utterance, text, index markers, and the return, is one chunk,
+ * and goes out in one write if the synth has room for it.
+ * There is a lane for each priority, and the highest lane with anything
+ * in it goes next, though a chunk that is partly sent is finished first,
+ * so bytes of different utterances are never mixed.
+ * An interrupt doesn't wait for speech that is partly sent;
+ * that speech is cancelled, and the interrupt is a control character anyways.
+ * But a control string that is partly sent goes out whole first. */
+struct ss_chunk {
+	struct ss_chunk *next;
+	int len, sent, room;
+	unsigned char data[0];
+};
+
+static struct ss_chunk *lane_head[ACS_SY_LANES], *lane_tail[ACS_SY_LANES];
+static struct ss_chunk *ss_free; // chunks to use again
+static struct ss_chunk *ss_open; // the utterance being put together
+static int ss_lane = ACS_SY_LANE_ECHO; // where it goes
+static int busy_lane = -1; // lane whose first chunk is partly sent
+static int nb_fd = -1; // the descriptor we made nonblocking
+
+/* A chunk that grew past this, for a long paragraph,
+ * is given back to the system when it comes off the free list,
+ * rather than used again. */
+#define SS_KEEPSIZE 4096
+
+/* Drop a whole lane, however long it is, onto the free list. */
+static void ss_cancel(int lane)
+{
+if(!lane_head[lane]) return;
+lane_tail[lane]->next = ss_free;
+ss_free = lane_head[lane];
+lane_head[lane] = lane_tail[lane] = 0;
+if(busy_lane == lane) busy_lane = -1;
+} /* ss_cancel */
+
+/* make room for n more bytes in the open chunk */
+static int ss_room(int n)
+{
+struct ss_chunk *c = ss_open;
+int room;
+
+if(c && c->len + n <= c->room) return 0;
+if(!c && ss_free) {
+c = ss_free;
+ss_free = c->next;
+if(c->room > SS_KEEPSIZE) {
+free(c);
+c = 0;
+} else {
+c->len = c->sent = 0;
+ss_open = c;
+if(n <= c->room) return 0;
+}
+}
+
+room = (c ? c->len : 0) + n + 256;
+c = realloc(c, sizeof(struct ss_chunk) + room);
+if(!c) return -1;
+if(!ss_open) c->len = c->sent = 0;
+c->room = room;
+ss_open = c;
+return 0;
+} /* ss_room */
+
+int acs_sy_pending(void)
+{
+int j;
+for(j=0; j<ACS_SY_LANES; ++j)
+if(lane_head[j]) return 1;
+return 0;
+} /* acs_sy_pending */
+
+void acs_sy_flush(void)
+{
+struct ss_chunk *c;
+int lane, n;
+
+if(acs_sy_fd1 < 0) return;
+if(acs_sy_fd1 != nb_fd) {
+fcntl(acs_sy_fd1, F_SETFL, fcntl(acs_sy_fd1, F_GETFL) | O_NONBLOCK);
+nb_fd = acs_sy_fd1;
+}
+
+while(1) {
+/* speech that is partly sent gives way to an interrupt */
+if(lane_head[ACS_SY_LANE_INTERRUPT] && busy_lane > ACS_SY_LANE_CONTROL)
+ss_cancel(busy_lane);
+if(busy_lane >= 0) lane = busy_lane;
+else if(lane_head[ACS_SY_LANE_INTERRUPT]) lane = ACS_SY_LANE_INTERRUPT;
+else {
+for(lane=0; lane<ACS_SY_LANES; ++lane)
+if(lane_head[lane]) break;
+if(lane == ACS_SY_LANES) return;
+}
+
+c = lane_head[lane];
+n = write(acs_sy_fd1, c->data + c->sent, c->len - c->sent);
+if(n < 0) {
+if(errno == EINTR) continue;
+if(errno == EAGAIN || errno == EWOULDBLOCK) return;
+/* The synth is gone; nothing queued is going anywhere. */
+acs_log("synth write failed, errno %d\n", errno);
+for(lane=0; lane<ACS_SY_LANES; ++lane)
+ss_cancel(lane);
+return;
+}
+
+c->sent += n;
+if(c->sent < c->len) {
+busy_lane = lane;
+continue;
+}
+
+/* this one is done */
+lane_head[lane] = c->next;
+if(!c->next) lane_tail[lane] = 0;
+c->next = ss_free;
+ss_free = c;
+if(busy_lane == lane) busy_lane = -1;
+}
+} /* acs_sy_flush */
+
+/* Put the open chunk on the end of its lane, and send what we can. */
+static void ss_end(void)
+{
+struct ss_chunk *c = ss_open;
+if(c && c->len) {
+c->next = 0;
+if(lane_tail[ss_lane]) lane_tail[ss_lane]->next = c;
+else lane_head[ss_lane] = c;
+lane_tail[ss_lane] = c;
+ss_open = 0;
+}
+acs_sy_flush();
+} /* ss_end */
+
+static void ss_put(const char *s, int n)
+{
+if(ss_room(n)) {
+/* No memory; send what is queued, and lose this. */
+acs_log("no memory for %d bytes of synth text\n", n);
+ss_end();
+return;
+}
+memcpy(ss_open->data + ss_open->len, s, n);
+ss_open->len += n;
+} /* ss_put */
+
+/* unicodes, converted to utf8 */
+static void ss_putmix(const unsigned int *s, int n)
+{
+int l = acs_uni2utf8_buf(s, n, 0, 0);
+if(ss_room(l+1)) {
+acs_log("no memory for %d bytes of synth text\n", l);
+ss_end();
+return;
+}
+acs_uni2utf8_buf(s, n, ss_open->data + ss_open->len, l+1);
+ss_open->len += l;
+} /* ss_putmix */
+
+/* end the utterance and send it */
 static void ss_cr(void)
 {
 if(acs_style == ACS_SY_STYLE_DECEXP || acs_style == ACS_SY_STYLE_DECPC)
-write(acs_sy_fd1, &kbyte, 1);
-write(acs_sy_fd1, &crbyte, 1);
+ss_put(&kbyte, 1);
+ss_put(&crbyte, 1);
+ss_end();
 }
 
 /* The start of the sentence that is sent with index markers. */
-unsigned int *acs_imark_start;
+acs_pos_type acs_imark_start;
 
 /* location of each index marker relative to acs_imark_start */
 static acs_ofs_type imark_loc[100];
@@ -203,6 +372,7 @@ return -1;
 acs_sy_fd0 = open(devname, O_RDWR|O_NONBLOCK);
 if(acs_sy_fd0 < 0) return 0;
 acs_sy_fd1 = acs_sy_fd0;
+nb_fd = -1;
 
 // Set up the tty characteristics.
 // Especially important to have no echo and no cooked mode and clocal.
@@ -233,7 +403,11 @@ return 0;
 
 void acs_sy_close(void)
 {
+int j;
 if(acs_sy_fd0 < 0) return; // already closed
+for(j=0; j<ACS_SY_LANES; ++j)
+ss_cancel(j);
+nb_fd = -1;
 close(acs_sy_fd0);
 if(acs_sy_fd1 != acs_sy_fd0)
 close(acs_sy_fd1);
@@ -241,30 +415,50 @@ acs_sy_fd0 = acs_sy_fd1 = -1;
 } // acs_sy_close
 
 static fd_set channels;
+static fd_set exceptions; // screen changes, from the vcsa poll
+static fd_set writable; // the synth can take more of the output queue
 
 int acs_wait(void)
 {
 int rc;
 int nfds;
+int vcs = (acs_screen_h && acs_vcs_fd >= 0 ? acs_vcs_fd : -1);
+int out;
 
+top:
+out = (acs_sy_fd1 >= 0 && acs_sy_pending() ? acs_sy_fd1 : -1);
 memset(&channels, 0, sizeof(channels));
+memset(&exceptions, 0, sizeof(exceptions));
+memset(&writable, 0, sizeof(writable));
 FD_SET(acs_fd, &channels);
 if(acs_sy_fd0 >= 0)
 FD_SET(acs_sy_fd0, &channels);
 if(fifo_fd >= 0)
 FD_SET(fifo_fd, &channels);
+if(vcs >= 0)
+FD_SET(vcs, &exceptions);
+if(out >= 0)
+FD_SET(out, &writable);
 
 nfds = acs_fd;
 if(acs_sy_fd0 > nfds) nfds = acs_sy_fd0;
 if(fifo_fd > nfds) nfds = fifo_fd;
+if(vcs > nfds) nfds = vcs;
+if(out > nfds) nfds = out;
 ++nfds;
-rc = select(nfds, &channels, 0, 0, 0);
+rc = select(nfds, &channels, &writable, &exceptions, 0);
 if(rc < 0) return; // should never happen
 
 rc = 0;
 if(FD_ISSET(acs_fd, &channels)) rc |= 1;
 if(acs_sy_fd0 >= 0 && FD_ISSET(acs_sy_fd0, &channels)) rc |= 2;
 if(fifo_fd >= 0 && FD_ISSET(fifo_fd, &channels)) rc |= 4;
+if(vcs >= 0 && FD_ISSET(vcs, &exceptions)) rc |= 8;
+/* Feeding the synth is our business, not the caller's. */
+if(out >= 0 && FD_ISSET(out, &writable)) {
+acs_sy_flush();
+if(!rc) goto top;
+}
 return rc;
 } // acs_wait
 
@@ -368,6 +562,8 @@ int acs_all_events(void)
 int source = acs_wait();
 if(source&4) ip_more();
 if(source&2) acs_sy_events();
+/* the cursor is current before the tty output is processed */
+if(source&8) acs_screen_events();
 if(source&1) acs_events();
 } // acs_all_events
 
@@ -375,29 +571,34 @@ if(source&1) acs_events();
 void acs_say_string(const char *s)
 {
 int l = strlen(s);
-if(l) write(acs_sy_fd1, s, l);
+ss_lane = ACS_SY_LANE_ECHO;
+if(l) ss_put(s, l);
 ss_cr();
 } // acs_say_string
 
 void acs_say_string_n(const char *s)
 {
 int l = strlen(s);
-if(l) write(acs_sy_fd1, s, l);
+ss_lane = ACS_SY_LANE_ECHO;
+if(l) ss_put(s, l);
+ss_end();
 } // acs_say_string_n
 
 void acs_say_char(unsigned int c)
 {
 char *s = acs_getpunc(c);
-if(s) acs_say_string_n(s);
+ss_lane = ACS_SY_LANE_ECHO;
+if(s) ss_put(s, strlen(s));
 else
-acs_write_mix(acs_sy_fd1, &c, 1);
+ss_putmix(&c, 1);
 ss_cr();
 } // acs_say_char
 
 void acs_say_string_uc(const unsigned int *s)
 {
 int l = acs_unilen(s);
-if(l) acs_write_mix(acs_sy_fd1, s, l);
+ss_lane = ACS_SY_LANE_ECHO;
+if(l) ss_putmix(s, l);
 ss_cr();
 } /* acs_say_string_uc */
 
@@ -413,13 +614,14 @@ imark_end = 0;
 
 if(acs_style == ACS_SY_STYLE_BNS || acs_style == ACS_SY_STYLE_ACE) mark = 0;
 imark_first = mark;
+ss_lane = ACS_SY_LANE_READING;
 
 t = s;
 while(1) {
 if(*o && mark >= 0 && mark <= 100) { // mark here
 // have to send the prior word
 if(s > t)
-acs_write_mix(acs_sy_fd1, t, s-t);
+ss_putmix(t, s-t);
 t = s;
 // set the index marker
 imark_loc[imark_end++] = *o;
@@ -449,7 +651,7 @@ sprintf(ibuf, "[:i r %d]", mark);
 break;
 } // switch
 if(ibuf[0])
-write(acs_sy_fd1, ibuf, strlen(ibuf));
+ss_put(ibuf, strlen(ibuf));
 ++mark;
 }
 if(!*s) break;
@@ -460,7 +662,7 @@ if(!*s) break;
  * so there should be nothing else to send.
  * But just in case ... */
 if(s > t)
-acs_write_mix(acs_sy_fd1, t, s-t);
+ss_putmix(t, s-t);
 
 ss_cr();
 acs_log("sent %d markers, last offset %d\n", imark_end, imark_loc[imark_end-1]);
@@ -482,7 +684,13 @@ ibyte = 3;
 break;
 } // switch
 
-write(acs_sy_fd1, &ibyte, 1);
+/* Anything not yet said is moot, but settings still go through. */
+ss_cancel(ACS_SY_LANE_READING);
+ss_cancel(ACS_SY_LANE_ECHO);
+if(ss_open) ss_open->len = 0;
+ss_lane = ACS_SY_LANE_INTERRUPT;
+ss_put(&ibyte, 1);
+ss_end();
 
 acs_imark_start = 0;
 bnsf = 0;
@@ -492,7 +700,9 @@ acs_log("shutup\n");
 static void
 ss_writeString(const char *s)
 {
-write(acs_sy_fd1, s, strlen(s));
+ss_lane = ACS_SY_LANE_CONTROL;
+ss_put(s, strlen(s));
+ss_end();
 } /* ss_writeString */
 
 int acs_setvolume(int n)
@@ -748,7 +958,7 @@ return rc ^ 1;
 int acs_stillTalking(void)
 {
 /* If we're blocked then we're definitely still talking. */
-if(ss_blocking()) return 1;
+if(acs_sy_pending() || ss_blocking()) return 1;
 
 /* Might put in some special code for doubletalk,
  * as they use ring indicator to indicate speech in progress.
@@ -812,6 +1022,7 @@ exit(1);
 default: /* parent */
 acs_sy_fd0 = p0[0];
 acs_sy_fd1 = p1[1];
+nb_fd = -1;
 close(p0[1]);
 close(p1[0]);
 } /* switch */
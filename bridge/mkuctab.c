@@ -0,0 +1,178 @@
+/*********************************************************************
+File: mkuctab.c
+Description: build the unicode tables behind acs_isalpha, acs_unaccent, etc.
+This runs at build time and writes acsuctab.c on stdout.
+The rules are here, one language at a time, written for clarity;
+the tables let the bridge look up any character in one or two loads.
+
+Each table covers the basic multilingual plane in two levels.
+acs_uc_index[lang][c>>8] picks a block of 256 entries,
+and the entry for c is acs_uc_blocks[block][c&0xff].
+Blocks that come out the same are stored once,
+so almost every page points to the same block of nothing.
+The low byte of an entry is the unaccented ascii character,
+the high byte holds the ACS_UC bits below.
+Characters above the plane are not letters, and unaccent to '?'.
+
+To bring in a new language, add its letters to isLetter(),
+and any new accents to unaccent(), and rebuild.
+*********************************************************************/
+
+#include <stdio.h>
+#include <string.h>
+#include <ctype.h>
+
+#include "acsbridge.h"
+
+#define NLANGS (ACS_LANG_PL+1)
+#define MAXBLOCKS 256
+
+static unsigned short blocks[MAXBLOCKS][256];
+static int nblocks;
+static unsigned char index_tab[NLANGS][256];
+
+static int isLetter(int lang, unsigned int c)
+{
+	if(c < 0x80 && isalpha(c)) return 1;
+
+	switch(lang) {
+	case ACS_LANG_DE:
+		if(c == 0xdf) return 1;
+		c |= 0x20;
+		if(c == 0xe4 || c == 0xfc || c == 0xf6) return 1;
+		break;
+
+	case ACS_LANG_PT_BR:
+		c |= 0x20;
+		if( c == 0xe0 || c == 0xe1 || c == 0xe2 || c == 0xe3 || c == 0xe7) return 1;
+		if(c == 0xe9 || c == 0xea || c == 0xed) return 1;
+		if(c == 0xf3 || c == 0xf4 || c == 0xf5 || c == 0xfa || c == 0xfc) return 1;
+		break;
+
+	case ACS_LANG_FR:
+		c |= 0x20;
+		if(c == 0xe0 || c == 0xe8 || c == 0xe9 || c == 0xea || c == 0xee) return 1;
+		if(c == 0xf4 || c == 0xfb) return 1;
+		break;
+
+	}
+
+	return 0;
+} /* isLetter */
+
+/* Same for every language, and like acs_isvowel,
+ * it folds case without asking whether c is a letter. */
+static int isVowel(unsigned int c)
+{
+	static const unsigned char wv[] = {
+1,1,1,1,1,1,0,0,1,1,1,1,1,1,1,1,
+1,0,1,1,1,1,1,0,1,1,1,1,1,0,0,0,
+1,1,1,1,1,1,0,0,1,1,1,1,1,1,1,1,
+1,0,1,1,1,1,1,0,1,1,1,1,1,0,0,1,
+	};
+
+	if(c != 0xdf) c |= 0x20;
+	if (c == 'a' || c == 'e' || c == 'i' || c == 'o' || c == 'u' || c == 'y')
+		return 1;
+	if(c >= 0xc0 && c < 0x100) return wv[c-0xc0];
+	// higher voweles not yet implemented
+	return 0;
+} /* isVowel */
+
+/* Turn unicode into lower case ascii, as best we can. */
+static char unaccent(unsigned int c)
+{
+	static const char down[256+1] =
+	"\0......\07.\t\n.\f\r.."
+	"................"
+	" !\"#$%&'()*+,-./"
+	"0123456789:;<=>?"
+	"@abcdefghijklmno"
+	"pqrstuvwxyz[\\]^_"
+	"`abcdefghijklmno"
+	"pqrstuvwxyz{|}~\177"
+	"..........s....."
+	"..........s....y"
+	" ..............."
+	"................"
+	"aaaaaaa eeeeiiii"
+	"dnooooo.ouuuuy.s"
+	"aaaaaaaceeeeiiii"
+	".nooooo.ouuuuy.y";
+	static const unsigned int in_c[] = {
+0x95, 0x99, 0x9c, 0x9d, 0x91, 0x92, 0x93, 0x94,
+0xa0, 0xad, 0x96, 0x97, 0x85,
+0x2022, 0x25ba, 0x113, 0x2013, 0x2014,
+0x2018, 0x2019, 0x201c, 0x201d, 0x200e,
+0x2010, 0};
+	static const char out_c[] =
+"*'`'`'`' ----**`--`'`' -";
+	int i;
+
+	if(c < 0x100) return down[c];
+	for(i=0; in_c[i]; ++i)
+		if(c == in_c[i]) return out_c[i];
+	return '?';
+} /* unaccent */
+
+static unsigned short entry(int lang, unsigned int c)
+{
+	unsigned short e = (unsigned char)unaccent(c);
+	if(isLetter(lang, c)) e |= ACS_UC_ALPHA << 8;
+	if(c >= '0' && c <= '9') e |= ACS_UC_DIGIT << 8;
+	if(c < 0x80 && isspace(c)) e |= ACS_UC_SPACE << 8;
+	if(isVowel(c)) e |= ACS_UC_VOWEL << 8;
+	return e;
+} /* entry */
+
+/* Find this block among the ones we have, or add it. */
+static int addBlock(const unsigned short *b)
+{
+	int i;
+	for(i=0; i<nblocks; ++i)
+		if(!memcmp(blocks[i], b, sizeof(blocks[i]))) return i;
+	if(nblocks == MAXBLOCKS) {
+		fprintf(stderr, "mkuctab: more than %d different blocks\n", MAXBLOCKS);
+		return -1;
+	}
+	memcpy(blocks[nblocks], b, sizeof(blocks[nblocks]));
+	return nblocks++;
+} /* addBlock */
+
+int main(void)
+{
+	unsigned short b[256];
+	int lang, page, j, k;
+
+	for(lang=0; lang<NLANGS; ++lang) {
+		for(page=0; page<256; ++page) {
+			for(j=0; j<256; ++j)
+				b[j] = entry(lang, (page<<8) | j);
+			if((k = addBlock(b)) < 0) return 1;
+			index_tab[lang][page] = k;
+		}
+	}
+
+	printf("/* acsuctab.c: generated by mkuctab, do not edit. */\n\n");
+	printf("#include \"acsbridge.h\"\n\n");
+
+	printf("const unsigned char acs_uc_index[%d][256] = {\n", NLANGS);
+	for(lang=0; lang<NLANGS; ++lang) {
+		printf("{");
+		for(page=0; page<256; ++page)
+			printf("%s%d,", (page%32 ? "" : "\n"), index_tab[lang][page]);
+		printf("\n},\n");
+	}
+	printf("};\n\n");
+
+	printf("const unsigned short acs_uc_blocks[%d][256] = {\n", nblocks);
+	for(k=0; k<nblocks; ++k) {
+		printf("{");
+		for(j=0; j<256; ++j)
+			printf("%s0x%x,", (j%16 ? "" : "\n"), blocks[k][j]);
+		printf("\n},\n");
+	}
+	printf("};\n");
+
+	return 0;
+} /* main */
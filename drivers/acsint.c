@@ -19,6 +19,14 @@
 #include <linux/miscdevice.h>
 #include <linux/version.h>
 #include <linux/poll.h>
+#include <linux/log2.h>
+#include <linux/vmalloc.h>
+#include <linux/mm.h>
+#include <linux/workqueue.h>
+#include <linux/mutex.h>
+#include <linux/rwsem.h>
+#include <linux/ktime.h>
+#include <linux/irq_work.h>
 
 #include "ttyclicks.h"
 #include "acsint.h"
@@ -38,20 +46,54 @@ MODULE_PARM_DESC(major,
 /* For various critical sections of code. */
 static DEFINE_RAW_SPINLOCK(acslock);
 
-/* circular buffer of output characters received from the tty */
+#ifndef READ_ONCE
+#define READ_ONCE(x) ACCESS_ONCE(x)
+#define WRITE_ONCE(x, val) (ACCESS_ONCE(x) = (val))
+#endif
+
+/* circular buffer of output characters received from the tty.
+ * head, tail, mark and echopoint run freely,
+ * and are masked down to an index into area[].
+ * The area comes from vmalloc, so it can be mapped into user space;
+ * see device_mmap() below.
+ * Its size, in bytes of utf8, is a power of 2 between a page and CB_MAX,
+ * and can be changed on the fly; see cb_resize(). */
+#define CB_SIZE 65536		/* default size */
+#define CB_MAX_SHIFT 24
+#define CB_MAX (1 << CB_MAX_SHIFT)
+#define CB_STAGE 256		/* staged characters, a power of 2 */
+/* A staged character from printk, that can't be echo */
+#define CB_KMSG 0x80000000
 struct cbuf {
-	unsigned int area[65536];
-	unsigned int *start, *end;
-	unsigned int *head, *tail;
+	unsigned char *area;	/* utf8 */
+	unsigned int size, mask;
+	unsigned int head, tail;
 /* mark the place where we last copied data to user space */
-	unsigned int *mark;
+	unsigned int mark;
 /* Mark the point where we last saw an echo character */
-	unsigned int *echopoint;
+	unsigned int echopoint;
+	bool echoset;		/* echopoint is valid */
+	u64 stamp;		/* when the last character was logged */
+/* Bytes that ran out of the ring, or were trimmed off a catch up,
+ * before user space saw them, and why; ACS_LOST_* bits.
+ * The prev fields put things back if a catch up doesn't fit. */
+	unsigned int lost, lostwhy;
+	unsigned int prevmark, prevlost, prevwhy;
+/* Characters from the notifier, waiting to be logged.
+ * The notifier puts them on at stage_head without taking any lock,
+ * and cb_flush() takes them off at stage_tail, under the spinlock. */
+	unsigned int stage[CB_STAGE];
+	unsigned int stage_head, stage_tail;
 };
 
 /* These are allocated, one per console, as needed. */
 static struct cbuf *cbuf_tty[MAX_NR_CONSOLES];
 
+static int ringsize = CB_SIZE;
+module_param(ringsize, int, 0);
+MODULE_PARM_DESC(ringsize,
+		 "bytes of tty log per console, rounded up to a power of 2");
+
 /* in case we can't malloc a buffer */
 static const char cb_nomem_message[] =
     "Kernel cannot allocate space for this console";
@@ -59,38 +101,128 @@ static const char cb_nomem_message[] =
 /* set to 1 if you have sent the above nomem message down to the user */
 static unsigned char cb_nomem_refresh[MAX_NR_CONSOLES];
 
-/* set to 1 if you have tried to allocate */
+/* set to 1 if you have tried to allocate, 2 if the allocation failed */
 static unsigned char cb_nomem_alloc[MAX_NR_CONSOLES];
 
 /* Staging area to copy tty data down to user space */
-/* This is a snapshot of the circular buffer. */
-static unsigned int cb_staging[65536];
+/* This is a snapshot of the end of the circular buffer, still in utf8.
+ * It holds user_bufsize characters, unless they are mostly wide. */
+static unsigned char cb_staging[CB_SIZE];
+
+/* The mapping of the device, so we can pull pages out from under
+ * user space when a ring is resized. */
+static struct address_space *acs_mapping;
+
+/* One reader at a time uses the staging area. */
+static DEFINE_MUTEX(staging_mutex);
+
+/* One resize at a time.  And a page fault on a ring holds ring_sem
+ * for reading, so it can't hand out a page of a ring that is going away. */
+static DEFINE_MUTEX(resize_mutex);
+static DECLARE_RWSEM(ring_sem);
+
+/* Does user space want the catch up text in utf8?
+ * If not, it is expanded to 4 byte unicodes on the way down. */
+static bool compact_text;
 
 /* size of userland buffer; characters will copy from staging to this buffer */
 static int user_bufsize = 256;
 
+/* The first page of the mmap region, describing each console's ring.
+ * The rings follow, in order by console, each in a slot of CB_MAX bytes. */
+static struct acs_mmap_header *mmhdr;
+
+/* Has user space mapped the rings?
+ * If so, the catch up passes positions rather than characters. */
+static bool text_mapped;
+
 /* jiffies value for the last output character. */
 /* This is reset if the last output character is echo. */
 static unsigned long last_oj;
 /* How many tenths of a second separate one burst of output from the next? */
 static int outputbreak = 5;
 
-/* Initialize / reset the variables in the circular buffer. */
-static void cb_reset(struct cbuf *cb)
+/* Initialize / reset the variables in the circular buffer.
+ * mino is minor-1, a 0 based index into arrays, similar to fg_console. */
+static void cb_reset(int mino)
 {
+	struct cbuf *cb = cbuf_tty[mino];
+	struct acs_mmap_console *mc = mmhdr->con + mino;
+
 	if (!cb)
 		return;		/* never allocated */
-	cb->start = cb->area;
-	cb->end = cb->area + 65536;
-	cb->head = cb->start;
-	cb->tail = cb->start;
-	cb->mark = cb->start;
+	cb->head = 0;
+	cb->tail = 0;
+	cb->mark = 0;
 	cb->echopoint = 0;
+	cb->echoset = false;
+	cb->lost = cb->lostwhy = 0;
+	/* stage_head belongs to the notifier; just skip what is staged */
+	cb->stage_tail = READ_ONCE(cb->stage_head);
+
+	/* The ring starts over; tell anyone who has it mapped. */
+	++mc->seq;
+	smp_wmb();
+	mc->size = cb->size;
+	mc->head = 0;
+	mc->mark = 0;
+	++mc->gen;
+	smp_wmb();
+	++mc->seq;
+}
+
+/* Allocate the circular buffer for a console.
+ * This uses vmalloc, and can sleep. */
+static void cb_alloc(int mino)
+{
+	struct cbuf *cb;
+	unsigned long irqflags;
+
+	cb = kzalloc(sizeof(*cb), GFP_KERNEL);
+	if (cb) {
+		cb->size = ringsize;
+		cb->mask = ringsize - 1;
+		cb->area = vmalloc_user(ringsize);
+	}
+	if (!cb || !cb->area) {
+		kfree(cb);
+		printk(KERN_ERR "Failed to allocate memory for console %d.\n",
+		       mino + 1);
+		cb_nomem_alloc[mino] = 2;
+		return;
+	}
+
+	raw_spin_lock_irqsave(&acslock, irqflags);
+	if (cbuf_tty[mino]) {
+		/* somebody beat us to it */
+		raw_spin_unlock_irqrestore(&acslock, irqflags);
+		vfree(cb->area);
+		kfree(cb);
+		return;
+	}
+	cbuf_tty[mino] = cb;
+	cb_reset(mino);
+	raw_spin_unlock_irqrestore(&acslock, irqflags);
 }
 
+/* The notifiers can't sleep, so they leave allocation to a work queue.
+ * Characters sent to a brand new console, before its buffer is ready,
+ * are not logged. */
+static DECLARE_BITMAP(cb_alloc_pending, MAX_NR_CONSOLES);
+
+static void cb_alloc_work(struct work_struct *work)
+{
+	int j;
+
+	for (j = 0; j < MAX_NR_CONSOLES; ++j)
+		if (test_and_clear_bit(j, cb_alloc_pending))
+			cb_alloc(j);
+}
+
+static DECLARE_WORK(alloc_work, cb_alloc_work);
+
 /* check to see if the circular buffer was allocated. */
 /* If never attempted, try to allocate it. */
-/* mino is minor-1, a 0 based index into arrays, similar to fg_console. */
 static void checkAlloc(int mino, bool from_vt)
 {
 	struct cbuf *cb = cbuf_tty[mino];
@@ -99,40 +231,199 @@ static void checkAlloc(int mino, bool from_vt)
 	if (cb_nomem_alloc[mino])
 		return;		/* already tried to allocate */
 	cb_nomem_alloc[mino] = 1;
-	cb = kmalloc(sizeof(*cb), (from_vt ? GFP_ATOMIC : GFP_KERNEL));
-	if (!cb) {
-		printk(KERN_ERR "Failed to allocate memory for console %d.\n",
-		       mino + 1);
+	if (from_vt) {
+		set_bit(mino, cb_alloc_pending);
+		schedule_work(&alloc_work);
 		return;
 	}
-	cb_reset(cb);
-	cbuf_tty[mino] = cb;
+	cb_alloc(mino);
 }
 
-/* Put a character on the end of the circular buffer.
- * Drop the oldest character if the buffer is full.
+/* Drop the oldest character from the circular buffer.
+ * That is its lead byte and any continuation bytes that follow. */
+static void cb_drop(struct cbuf *cb)
+{
+	++cb->tail;
+	while (cb->tail != cb->head &&
+	       (cb->area[cb->tail & cb->mask] & 0xc0) == 0x80)
+		++cb->tail;
+	if ((int)(cb->mark - cb->tail) < 0) {
+		/* user space never saw these */
+		cb->lost += cb->tail - cb->mark;
+		cb->lostwhy |= ACS_LOST_OVERWRITTEN;
+		cb->mark = cb->tail;
+	}
+	if (cb->echoset && (int)(cb->echopoint - cb->tail) < 0)
+		cb->echoset = false;
+}
+
+/* Put a character on the end of the circular buffer, in utf8.
+ * Drop the oldest characters if the buffer is full.
  * This is called under a spinlock, so we don't have to worry about the reader
  * draining characters while this routine adds characters on. */
 static void cb_append(struct cbuf *cb, unsigned int c)
 {
+	unsigned char u[4];
+	int j, n;
+
 	if (!cb)
 		return;		/* should never happen */
-	*cb->head = c;
-	++cb->head;
-	if (cb->head == cb->end)
-		cb->head = cb->start;
-	if (cb->head == cb->tail) {
-		/* buffer full, drop the last character */
-		if (cb->tail == cb->mark)
-			cb->mark = 0;
-		if (cb->tail == cb->echopoint)
-			cb->echopoint = 0;
-		++cb->tail;
-		if (cb->tail == cb->end)
-			cb->tail = cb->start;
+
+	if (c < 0x80) {
+		u[0] = c;
+		n = 1;
+	} else if (c < 0x800) {
+		u[0] = 0xc0 | (c >> 6);
+		u[1] = 0x80 | (c & 0x3f);
+		n = 2;
+	} else {
+		if (c > 0x10ffff)
+			c = 0xfffd;
+		if (c < 0x10000) {
+			u[0] = 0xe0 | (c >> 12);
+			n = 3;
+		} else {
+			u[0] = 0xf0 | (c >> 18);
+			u[1] = 0x80 | ((c >> 12) & 0x3f);
+			n = 4;
+		}
+		u[n - 2] = 0x80 | ((c >> 6) & 0x3f);
+		u[n - 1] = 0x80 | (c & 0x3f);
 	}
+
+	while (cb->head + n - cb->tail > cb->size)
+		cb_drop(cb);
+	for (j = 0; j < n; ++j)
+		cb->area[cb->head++ & cb->mask] = u[j];
+}
+
+/* Tell anyone who has the ring mapped how far it goes.
+ * The characters are in place before the new head is visible. */
+static void cb_publish(struct cbuf *cb, int mino)
+{
+	smp_wmb();
+	mmhdr->con[mino].head = cb->head;
 }
 
+/* Staged characters are logged by irq_work, or sooner if we need them. */
+static void cb_flush(int mino);
+static void cb_flush_all(void);
+
+/* Copy positions from through to-1 from one ring to another,
+ * a page at a time at most, with the lock dropped in between,
+ * so logging goes on while we copy. */
+static void cb_copy(const unsigned char *old, unsigned int oldmask,
+		    unsigned char *area, unsigned int mask,
+		    unsigned int from, unsigned int to)
+{
+	unsigned int n;
+
+	while (from != to) {
+		n = to - from;
+		if (n > PAGE_SIZE)
+			n = PAGE_SIZE;
+		if (n > oldmask + 1 - (from & oldmask))
+			n = oldmask + 1 - (from & oldmask);
+		if (n > mask + 1 - (from & mask))
+			n = mask + 1 - (from & mask);
+		memcpy(area + (from & mask), old + (from & oldmask), n);
+		from += n;
+		cond_resched();
+	}
+}
+
+/* Change the size of a console's ring, keeping as much of the text as fits.
+ * The positions don't change, just the mask,
+ * so user space doesn't lose its place.
+ * The text is copied without the lock, while new text keeps coming in.
+ * Anything logged meanwhile is copied on the next pass,
+ * until what is left is less than a page, which is copied under the lock,
+ * along with the swap.  Text that is overwritten in the old ring
+ * while we copy it is behind the tail by then, so it doesn't matter. */
+static void cb_resize(int mino, unsigned int size)
+{
+	struct cbuf *cb;
+	unsigned char *area, *old;
+	struct acs_mmap_console *mc = mmhdr->con + mino;
+	unsigned int oldmask, from, head, done;
+	unsigned long irqflags;
+	int passes;
+
+	mutex_lock(&resize_mutex);
+	cb = cbuf_tty[mino];
+	if (!cb || cb->size == size) {
+		mutex_unlock(&resize_mutex);
+		return;
+	}
+	area = vmalloc_user(size);
+	if (!area) {
+		mutex_unlock(&resize_mutex);
+		printk(KERN_ERR "Failed to resize the log for console %d.\n",
+		       mino + 1);
+		return;
+	}
+
+	/* Only we change cb->area, and we hold the mutex. */
+	old = cb->area;
+	oldmask = cb->mask;
+	done = 0;
+	for (passes = 0;; ++passes) {
+		raw_spin_lock_irqsave(&acslock, irqflags);
+		cb_flush(mino);
+		head = cb->head;
+		from = cb->tail;
+		if (head - from > size)
+			from = head - size;
+		if (passes && (int)(done - from) > 0)
+			from = done;
+		if (head - from <= PAGE_SIZE || passes == 8)
+			break;
+		raw_spin_unlock_irqrestore(&acslock, irqflags);
+		cb_copy(old, oldmask, area, size - 1, from, head);
+		done = head;
+	}
+
+	/* Under the lock from here on. */
+	while (cb->head - cb->tail > size)
+		cb_drop(cb);
+	if ((int)(cb->tail - from) > 0)
+		from = cb->tail;
+	for (; from != cb->head; ++from)
+		area[from & (size - 1)] = old[from & oldmask];
+	head = cb->head;
+	raw_spin_unlock_irqrestore(&acslock, irqflags);
+
+	/* The swap, and the unmap, are safe from the fault handler. */
+	down_write(&ring_sem);
+	raw_spin_lock_irqsave(&acslock, irqflags);
+	/* whatever came in since, a few characters at most */
+	cb_flush(mino);
+	while (cb->head - cb->tail > size)
+		cb_drop(cb);
+	from = head;
+	if ((int)(cb->tail - from) > 0)
+		from = cb->tail;
+	for (; from != cb->head; ++from)
+		area[from & (size - 1)] = old[from & oldmask];
+	cb->area = area;
+	cb->size = size;
+	cb->mask = size - 1;
+	++mc->seq;
+	smp_wmb();
+	mc->size = size;
+	smp_wmb();
+	++mc->seq;
+	raw_spin_unlock_irqrestore(&acslock, irqflags);
+
+/* Anybody who has the old pages mapped must fault in the new ones. */
+	if (acs_mapping)
+		unmap_mapping_range(acs_mapping,
+				    PAGE_SIZE + (loff_t) mino * CB_MAX, CB_MAX, 1);
+	up_write(&ring_sem);
+	mutex_unlock(&resize_mutex);
+	vfree(old);
+}				/* cb_resize */
+
 /* Indicate which keys, by key code, are meta.  For example,
  * shift, alt, numlock, etc.  These are the state changing keys.
  * Also flag the simulated shift states, on or off, for shift,
@@ -142,54 +433,92 @@ static void cb_append(struct cbuf *cb, unsigned int c)
 
 #define ACS_SS_KERNEL 0x20 /* states handled by the kernel */
 
-static unsigned char ismeta[ACS_NUM_KEYS];
 static unsigned char metaflag[4];
 
+/* Indicate which keys should be captured by your running adapter.
+ * capture is an unsigned short, with a bit for each shift alt control combination.
+ * This includes the first bit, which corresponds to a shift state of 0,
+ * or the plain key.  You want that for function keys etc,
+ * but probably not for letters on the main keyboard.
+ * Those should always pass through to the console.
+ * But I don't place any restrictions on what is intercepted,
+ * so do whatever you like.
+ * If a key is captured, it can still be passed through to the console;
+ * that is passt.
+ *
+ * The keyboard notifier reads these tables under rcu,
+ * so it always sees a consistent map, even as the adapter reloads its
+ * configuration.  Writers build a new map and swap it in,
+ * under keymap_mutex. */
+
+struct keymap {
+	unsigned short capture[ACS_NUM_KEYS];
+	unsigned short passt[ACS_NUM_KEYS];
+	unsigned char ismeta[ACS_NUM_KEYS];
+	struct rcu_head rcu;
+};
+
+/* The first keymap is static, so loading the module can't fail for want of it. */
+static struct keymap keymap0;
+static struct keymap __rcu *keymap = &keymap0;
+static DEFINE_MUTEX(keymap_mutex);
+
 static void
-reset_meta(void)
+reset_meta(struct keymap *km)
 {
 	int j;
 
 	for (j = 0; j < ACS_NUM_KEYS; ++j)
-		ismeta[j] = 0;
+		km->ismeta[j] = 0;
 /* These all have to be less than ACS_NUM_KEYS */
-	ismeta[KEY_LEFTCTRL] = ACS_SS_KERNEL;
-	ismeta[KEY_RIGHTCTRL] = ACS_SS_KERNEL;
-	ismeta[KEY_LEFTSHIFT] = ACS_SS_KERNEL;
-	ismeta[KEY_RIGHTSHIFT] = ACS_SS_KERNEL;
-	ismeta[KEY_LEFTALT] = ACS_SS_KERNEL;
-	ismeta[KEY_RIGHTALT] = ACS_SS_KERNEL;
-	ismeta[KEY_CAPSLOCK] = ACS_SS_KERNEL;
-	ismeta[KEY_NUMLOCK] = ACS_SS_KERNEL;
-	ismeta[KEY_SCROLLLOCK] = ACS_SS_KERNEL;
+	km->ismeta[KEY_LEFTCTRL] = ACS_SS_KERNEL;
+	km->ismeta[KEY_RIGHTCTRL] = ACS_SS_KERNEL;
+	km->ismeta[KEY_LEFTSHIFT] = ACS_SS_KERNEL;
+	km->ismeta[KEY_RIGHTSHIFT] = ACS_SS_KERNEL;
+	km->ismeta[KEY_LEFTALT] = ACS_SS_KERNEL;
+	km->ismeta[KEY_RIGHTALT] = ACS_SS_KERNEL;
+	km->ismeta[KEY_CAPSLOCK] = ACS_SS_KERNEL;
+	km->ismeta[KEY_NUMLOCK] = ACS_SS_KERNEL;
+	km->ismeta[KEY_SCROLLLOCK] = ACS_SS_KERNEL;
 
 	for(j=0; j<4; ++j)
 		metaflag[j] = 0;
 } /* reset_meta */
 
-
-/* Indicate which keys should be captured by your running adapter.
- * This is an unsigned short, with a bit for each shift alt control combination.
- * This includes the first bit, which corresponds to a shift state of 0,
- * or the plain key.  You want that for function keys etc,
- * but probably not for letters on the main keyboard.
- * Those should always pass through to the console.
- * But I don't place any restrictions on what is intercepted,
- * so do whatever you like. */
-
-static unsigned short capture[ACS_NUM_KEYS];
-
-/* If a key is captured, it can still be passed through to the console. */
-
-static unsigned short passt[ACS_NUM_KEYS];
-
-static void clear_keys(void)
+static void clear_keys(struct keymap *km)
 {
 	int i;
 	for (i = 0; i < ACS_NUM_KEYS; i++)
-		capture[i] = passt[i] = 0;
+		km->capture[i] = km->passt[i] = 0;
 }
 
+/* Get a private copy of the keymap to change, if we don't have one already.
+ * Called with keymap_mutex held. */
+static struct keymap *keymap_edit(struct keymap *km)
+{
+	if (km)
+		return km;
+	km = kmalloc(sizeof(*km), GFP_KERNEL);
+	if (km)
+		memcpy(km, rcu_dereference_protected(keymap,
+						     lockdep_is_held(&keymap_mutex)),
+		       sizeof(*km));
+	return km;
+}				/* keymap_edit */
+
+/* Swap in the new keymap.  Called with keymap_mutex held. */
+static void keymap_publish(struct keymap *km)
+{
+	struct keymap *old;
+
+	if (!km)
+		return;
+	old = rcu_dereference_protected(keymap, lockdep_is_held(&keymap_mutex));
+	rcu_assign_pointer(keymap, km);
+	if (old != &keymap0)
+		kfree_rcu(old, rcu);
+}				/* keymap_publish */
+
 /* divert all keys to user space, to grab the next key or build a string. */
 static bool key_divert;
 
@@ -202,27 +531,130 @@ static bool key_bypass;
 
 /* The array "rbuf" is used for passing key/tty events to user space.
  * A reading buffer of sorts.  See device_read() below.
- * Despite the names head and tail, it's not a true circular buffer.
- * The process has to read the data before rbuf_head reaches rbuf_end,
- * or data is lost.
- * That's not a problem, because you just can't type faster
- * than the daemon can gather up those keystrokes.
- * Every event is 4 bytes, except echo, which is 8.
+ * This is a true circular buffer of fixed size events.
+ * rbuf_head and rbuf_tail run freely, and are masked down to an index,
+ * thus the number of events must be a power of 2.
+ * If the adapter falls behind and the ring fills up,
+ * new events are dropped and counted,
+ * and the count is passed down with the next read.
+ * Each event becomes 4 bytes in user space, except echo, which is 8.
  * Thus everything stays 4 byte aligned.
  * This is necessary to pass down unicodes.
  */
 
-#define RBUF_LEN 400
-static char rbuf[RBUF_LEN];
-static const char *rbuf_end = rbuf + RBUF_LEN;
-static char *rbuf_tail, *rbuf_head;
+struct acs_event {
+	unsigned char cmd;
+	unsigned char p1, p2, p3;
+	unsigned int c;		/* the unicode for MORECHARS */
+	unsigned int pos;	/* head of the foreground log at the time */
+	unsigned int seq;	/* numbered as it is posted, protocol 2 */
+	u64 ns;			/* when it happened, if we are stamping */
+};
+
+/* Does user space want timestamps on its events? */
+static bool stamp_events;
+
+/* Version of the event framing, set by ACS_PROTOCOL.
+ * Version 2 passes down the sequence number of each queued event.
+ * An event that is dropped uses up its number all the same,
+ * so a gap in the numbers means something was lost. */
+static int protocol = 1;
+static unsigned int post_seq;
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(3, 17, 0)
+#define ktime_get_ns() ktime_to_ns(ktime_get())
+#endif
+
+static u64 acs_now(void)
+{
+	return stamp_events ? ktime_get_ns() : 0;
+}				/* acs_now */
+
+static int rbufsize = 256;
+module_param(rbufsize, int, 0);
+MODULE_PARM_DESC(rbufsize,
+		 "number of events that can wait to be read, rounded up to a power of 2");
+
+static struct acs_event *rbuf;
+static unsigned int rbuf_mask;
+static unsigned int rbuf_tail, rbuf_head;
+/* number of events dropped since the last read */
+static unsigned int rbuf_dropped;
+/* Where is the last FGC event?  Events before it are superseded. */
+static unsigned int rbuf_fgc;
+static bool rbuf_hasfgc;
+/* Events that force a catch up, and echo events, since the last read */
+static bool rbuf_force, rbuf_echo;
 
 /* Wait until this driver has some data to read. */
 DECLARE_WAIT_QUEUE_HEAD(wq);
+/* Adapters that want SIGIO when there is something to read */
+static struct fasync_struct *acs_fasync;
+
+/* Tell the reader there is something new.
+ * This is done when the queue goes from empty to nonempty,
+ * and for the first event dropped, not for every event;
+ * a flood would otherwise be a flood of wakeups and signals,
+ * all under the spinlock.  A reader that drains the queue
+ * until EAGAIN never misses one. */
+static void rbuf_wake(void)
+{
+	wake_up_interruptible_poll(&wq, POLLIN | POLLRDNORM);
+	kill_fasync(&acs_fasync, SIGIO, POLL_IN);
+}				/* rbuf_wake */
 
 static bool in_use;		/* only one process opens this device at a time */
 static int last_fgc;		/* last fg_console */
 
+/* Put an event on the read queue, and wake up the reader if need be.
+ * This is called under the spinlock.
+ * Returns false if the queue is full and the event was dropped. */
+static bool rbuf_post(int cmd, int p1, int p2, int p3, unsigned int c)
+{
+	struct acs_event *ev;
+
+	if (rbuf_head - rbuf_tail > rbuf_mask) {
+		++post_seq;
+		/* whatever was lost, bring the log up to date on the next read */
+		rbuf_force = true;
+		if (!rbuf_dropped++)
+			rbuf_wake();
+		return false;
+	}
+
+	ev = rbuf + (rbuf_head & rbuf_mask);
+	ev->cmd = cmd;
+	ev->p1 = p1;
+	ev->p2 = p2;
+	ev->p3 = p3;
+	ev->c = c;
+	ev->pos = (cbuf_tty[fg_console] ? cbuf_tty[fg_console]->head : 0);
+	ev->seq = post_seq++;
+	ev->ns = acs_now();
+
+	if (cmd == ACS_FGC) {
+		rbuf_fgc = rbuf_head;
+		rbuf_hasfgc = true;
+	}
+	if (cmd != ACS_TTY_MORECHARS)
+		rbuf_force = true;
+	else if (p1)
+		rbuf_echo = true;
+
+	if (rbuf_head++ == rbuf_tail)
+		rbuf_wake();
+	return true;
+}				/* rbuf_post */
+
+/* Empty the read queue. */
+static void rbuf_reset(void)
+{
+	rbuf_head = rbuf_tail = 0;
+	rbuf_dropped = 0;
+	rbuf_hasfgc = false;
+	rbuf_force = rbuf_echo = false;
+}				/* rbuf_reset */
+
 /* Push characters onto the input queue of the foreground tty.
  * This is for macros, or cut&paste. */
 static void tty_pushstring(const char *cp, int len)
@@ -246,29 +678,53 @@ static void tty_pushstring(const char *cp, int len)
 static int device_open(struct inode *inode, struct file *file)
 {
 	int j;
+	struct keymap *km;
+	unsigned long irqflags;
 
 /* A theoretical race condition here; too unlikely for me to worry about. */
 	if (in_use)
 		return -EBUSY;
 
+/* Start with a clean keymap. */
+	mutex_lock(&keymap_mutex);
+	km = keymap_edit(NULL);
+	if (km) {
+		reset_meta(km);
+		clear_keys(km);
+		keymap_publish(km);
+	}
+	mutex_unlock(&keymap_mutex);
+	if (!km)
+		return -ENOMEM;
+
 	for (j = 0; j < MAX_NR_CONSOLES; ++j) {
-		cb_reset(cbuf_tty[j]);
+		cb_reset(j);
 		cb_nomem_refresh[j] = 0;
 		cb_nomem_alloc[j] = 0;
 	}
+	text_mapped = false;
+	compact_text = false;
+	stamp_events = false;
+	protocol = 1;
+	post_seq = 0;
+
+/* The notifiers can't allocate these buffers, so allocate them now,
+ * for every console that is in use.  Consoles opened later
+ * have their buffers allocated on the fly. */
+	for (j = 0; j < MAX_NR_CONSOLES; ++j)
+		if (vc_cons[j].d)
+			checkAlloc(j, false);
 
-	reset_meta();
-	clear_keys();
 	key_divert = false;
 	key_monitor = false;
 	key_bypass = false;
 
 /* At startup we tell the process which virtual console it is on.
  * Place this directive in rbuf to be read. */
-	rbuf[0] = ACS_FGC;
-	rbuf[1] = fg_console + 1;	/* minor number */
-	rbuf_tail = rbuf;
-	rbuf_head = rbuf + 4;
+	raw_spin_lock_irqsave(&acslock, irqflags);
+	rbuf_reset();
+	rbuf_post(ACS_FGC, fg_console + 1, 0, 0, 0);
+	raw_spin_unlock_irqrestore(&acslock, irqflags);
 	last_fgc = fg_console;
 	checkAlloc(fg_console, false);
 
@@ -276,13 +732,386 @@ static int device_open(struct inode *inode, struct file *file)
 	return 0;
 }
 
+static int device_fasync(int fd, struct file *file, int on)
+{
+	return fasync_helper(fd, file, on, &acs_fasync);
+}
+
 static int device_close(struct inode *inode, struct file *file)
 {
+	device_fasync(-1, file, 0);
 	in_use = false;
-	rbuf_head = rbuf_tail = rbuf;
+	rbuf_reset();
 	return 0;
 }
 
+/* Decode one utf8 character from the staging area, at position *jp.
+ * The driver wrote this text, so it is well formed,
+ * except that the front could be cut off by the ratchet. */
+static unsigned int utf8_1(const unsigned char *s, int len, int *jp)
+{
+	int j = *jp;
+	unsigned int c = s[j++];
+	int n = 0;
+
+	if (c >= 0xf0)
+		c &= 0x07, n = 3;
+	else if (c >= 0xe0)
+		c &= 0x0f, n = 2;
+	else if (c >= 0xc0)
+		c &= 0x1f, n = 1;
+	for (; n && j < len && (s[j] & 0xc0) == 0x80; --n)
+		c = (c << 6) | (s[j++] & 0x3f);
+	*jp = j;
+	return c;
+}				/* utf8_1 */
+
+/* Is this event from the queue, and numbered?
+ * The catch up, OVERRUN and DROPPED are made up as we read. */
+static bool event_numbered(int cmd)
+{
+	return (cmd != ACS_TTY_NEWCHARS && cmd != ACS_TTY_NEWUTF8 &&
+		cmd != ACS_TTY_MAPPED && cmd != ACS_OVERRUN &&
+		cmd != ACS_DROPPED);
+}				/* event_numbered */
+
+/* Does this event carry the 4 byte c field? */
+static bool event_has_c(int cmd)
+{
+	return (cmd == ACS_TTY_MORECHARS || cmd == ACS_TTY_MAPPED ||
+		cmd == ACS_TTY_NEWUTF8 || cmd == ACS_OVERRUN);
+}				/* event_has_c */
+
+/* The size of an event as it goes down to user space,
+ * not counting any characters that follow. */
+static int event_size(int cmd)
+{
+	int n = (event_has_c(cmd) ? 8 : 4);
+
+	if (protocol >= 2)
+		n += 8;
+	if (stamp_events)
+		n += 8;
+	return n;
+}				/* event_size */
+
+/* Copy one event down to user space.
+ * Returns the number of bytes, or 0 if there is no room. */
+static int event_to_user(char *buf, size_t len, const struct acs_event *ev)
+{
+	char evbuf[24];
+	int n = 4;
+	unsigned int seq;
+
+	if (len < event_size(ev->cmd))
+		return 0;
+
+	evbuf[0] = ev->cmd;
+	evbuf[1] = ev->p1;
+	evbuf[2] = ev->p2;
+	evbuf[3] = ev->p3;
+	if (event_has_c(ev->cmd)) {
+		memcpy(evbuf + 4, &ev->c, 4);
+		n = 8;
+	}
+/* Version 2 adds the sequence number and the ring position. */
+	if (protocol >= 2) {
+		seq = (event_numbered(ev->cmd) ? ev->seq : 0);
+		memcpy(evbuf + n, &seq, 4);
+		memcpy(evbuf + n + 4, &ev->pos, 4);
+		n += 8;
+	}
+/* The timestamp follows that. */
+	if (stamp_events) {
+		memcpy(evbuf + n, &ev->ns, 8);
+		n += 8;
+	}
+	if (copy_to_user(buf, evbuf, n))
+		return -EFAULT;
+	return n;
+}				/* event_to_user */
+
+/* Stage the text of a console, from its mark up to cup,
+ * so it can be copied down to user space.
+ * This is run from within a spinlock.
+ * If user space has the rings mapped, nothing is staged;
+ * *mapev tells it where the new text ends, and we return 0.
+ * Otherwise return the number of bytes staged.
+ * *lostev accounts for any text that user space will never see,
+ * and is an OVERRUN event if that is not zero. */
+static int cb_stage(int mino, unsigned int cup, struct acs_event *mapev,
+		    struct acs_event *lostev)
+{
+	struct cbuf *cb = cbuf_tty[mino];
+	int culen = cup - cb->mark;
+	int j, j2;
+
+	/* in case it doesn't fit, and we have to put it back */
+	cb->prevmark = cb->mark;
+	cb->prevlost = cb->lost;
+	cb->prevwhy = cb->lostwhy;
+
+	lostev->cmd = ACS_OVERRUN;
+	lostev->p1 = mino + 1;
+	lostev->p2 = cb->lostwhy;
+	lostev->p3 = 0;
+	lostev->c = cb->lost;
+	lostev->pos = cb->mark;
+	lostev->ns = cb->stamp;
+	cb->lost = 0;
+	cb->lostwhy = 0;
+
+	cb->mark = cup;
+	cb->echoset = false;
+	mmhdr->con[mino].mark = cup;
+
+	if (text_mapped) {
+		/* user space pulls the characters from the ring */
+		mapev->cmd = ACS_TTY_MAPPED;
+		mapev->p1 = mino + 1;
+		mapev->p2 = mapev->p3 = 0;
+		mapev->c = cup;
+		mapev->pos = cup;
+		mapev->ns = cb->stamp;
+		return 0;
+	}
+
+	/* The most we can stage is the end of the text. */
+	if (culen > sizeof(cb_staging)) {
+		lostev->c += culen - sizeof(cb_staging);
+		lostev->p2 |= ACS_LOST_TOOLONG;
+		culen = sizeof(cb_staging);
+		lostev->pos = cup - culen;
+	}
+	j = (cup - culen) & cb->mask;
+	/* One chunk or two. */
+	j2 = cb->size - j;
+	if (j2 > culen)
+		j2 = culen;
+	memcpy(cb_staging, cb->area + j, j2);
+	if (culen > j2)
+		memcpy(cb_staging + j2, cb->area, culen - j2);
+	return culen;
+}				/* cb_stage */
+
+/* The staged text didn't fit in the reader's buffer.
+ * Put the mark back, so it comes down next time.
+ * This is run from within a spinlock. */
+static void cb_unstage(int mino, unsigned int cup)
+{
+	struct cbuf *cb = cbuf_tty[mino];
+
+	if (!cb || cb->mark != cup)
+		return;		/* something else has happened since */
+	cb->mark = cb->prevmark;
+	cb->lost += cb->prevlost;
+	cb->lostwhy |= cb->prevwhy;
+	if ((int)(cb->mark - cb->tail) < 0) {
+		cb->lost += cb->tail - cb->mark;
+		cb->lostwhy |= ACS_LOST_OVERWRITTEN;
+		cb->mark = cb->tail;
+	}
+	mmhdr->con[mino].mark = cb->mark;
+}				/* cb_unstage */
+
+/* User space lost track of a console, and wants its text again,
+ * from position pos in the ring, or as far back as the ring goes.
+ * This is run from within a spinlock. */
+static void cb_resync(int mino, unsigned int pos)
+{
+	struct cbuf *cb = cbuf_tty[mino];
+
+	if (!cb)
+		return;
+	if ((int)(pos - cb->tail) < 0) {
+		cb->lost += cb->tail - pos;
+		cb->lostwhy |= ACS_LOST_OVERWRITTEN;
+		pos = cb->tail;
+	}
+	if ((int)(cb->head - pos) < 0)
+		pos = cb->head;
+	cb->mark = pos;
+	cb->echoset = false;
+	mmhdr->con[mino].mark = pos;
+/* The foreground console catches up on the next read;
+ * others are caught up by pread(). */
+	if (mino == fg_console)
+		rbuf_post(ACS_REFRESH, 0, 0, 0, 0);
+}				/* cb_resync */
+
+/* Tell user space that text was lost, protocol 2 only. */
+static int overrun_to_user(char *buf, size_t len,
+			   const struct acs_event *lostev)
+{
+	if (protocol < 2 || !lostev->c)
+		return 0;
+	return event_to_user(buf, len, lostev);
+}				/* overrun_to_user */
+
+/* The overrun, if any, and the mapped event, or nothing if they don't fit. */
+static int mapped_to_user(char *buf, size_t len,
+			  const struct acs_event *mapev,
+			  const struct acs_event *lostev)
+{
+	int need = event_size(ACS_TTY_MAPPED);
+	int bytes, n;
+
+	if (protocol >= 2 && lostev->c)
+		need += event_size(ACS_OVERRUN);
+	if (len < need)
+		return 0;
+	bytes = overrun_to_user(buf, len, lostev);
+	if (bytes < 0)
+		return bytes;
+	n = event_to_user(buf + bytes, len - bytes, mapev);
+	if (n < 0)
+		return n;
+	return bytes + n;
+}				/* mapped_to_user */
+
+/* Copy the staged text of a console down to user space,
+ * as 4 byte unicodes, or as utf8 if user space asked for compact text.
+ * The text ends at position cup in the console's ring,
+ * and ns is the time the last of it was logged.
+ * An OVERRUN event goes first, if any text was lost.
+ * Returns the number of bytes, 0 if there is no room, or -EFAULT. */
+static int staged_to_user(char *buf, size_t len, int mino, int culen,
+			  unsigned int cup, u64 ns, struct acs_event *lostev)
+{
+	struct acs_event cuev;
+	unsigned char *cusrc = cb_staging;
+	int cunum;		/* number of characters in the catch up */
+	int bytes = 0;
+	int skip, need;
+	int j, n;
+
+	/* don't start in the middle of a character */
+	while (culen && (*cusrc & 0xc0) == 0x80)
+		++cusrc, --culen;
+	cunum = 0;
+	for (j = 0; j < culen; ++j)
+		if ((cusrc[j] & 0xc0) != 0x80)
+			++cunum;
+/* ratchet down to the size of the userland buffer, in characters */
+	while (cunum > user_bufsize) {
+		++cusrc, --culen;
+		while (culen && (*cusrc & 0xc0) == 0x80)
+			++cusrc, --culen;
+		--cunum;
+	}
+	skip = cusrc - cb_staging;
+	if (skip && lostev->pos != cup - culen) {
+		lostev->c += cup - culen - lostev->pos;
+		lostev->p2 |= ACS_LOST_TOOLONG;
+	}
+	lostev->pos = cup - culen;
+
+	cuev.p1 = mino + 1;
+	cuev.pos = cup;
+	cuev.ns = ns;
+
+/* Make sure it all fits before we send any of it. */
+	need = (protocol >= 2 && lostev->c ? event_size(ACS_OVERRUN) : 0);
+	if (compact_text)
+		need += event_size(ACS_TTY_NEWUTF8) + ((culen + 3) & ~3);
+	else
+		need += event_size(ACS_TTY_NEWCHARS) + cunum * 4;
+	if (len < need)
+		return 0;
+
+	bytes = overrun_to_user(buf, len, lostev);
+	if (bytes < 0)
+		return bytes;
+
+	if (compact_text) {
+		static const char pad[3];
+		cuev.cmd = ACS_TTY_NEWUTF8;
+		cuev.p2 = cuev.p3 = 0;
+		cuev.c = culen;
+		n = event_to_user(buf + bytes, len - bytes, &cuev);
+		if (n < 0)
+			return n;
+		bytes += n;
+		if (culen && copy_to_user(buf + bytes, cusrc, culen))
+			return -EFAULT;
+		bytes += culen;
+		n = (-culen & 3);
+		if (n && copy_to_user(buf + bytes, pad, n))
+			return -EFAULT;
+		return bytes + n;
+	}
+
+	{
+		unsigned int chunk[64];
+/* The minor number is in p1, though I don't think we need it. */
+		cuev.cmd = ACS_TTY_NEWCHARS;
+		cuev.p2 = cunum;
+		cuev.p3 = (cunum >> 8);
+		n = event_to_user(buf + bytes, len - bytes, &cuev);
+		if (n < 0)
+			return n;
+		bytes += n;
+
+/* Expand the utf8 into unicodes, a chunk at a time. */
+		j = 0;
+		while (j < culen) {
+			for (n = 0; n < 64 && j < culen; ++n)
+				chunk[n] = utf8_1(cusrc, culen, &j);
+			if (copy_to_user(buf + bytes, chunk, n * 4))
+				return -EFAULT;
+			bytes += n * 4;
+		}
+	}
+
+	return bytes;
+}				/* staged_to_user */
+
+/* Catch up a console that is not necessarily in the foreground.
+ * This is pread() at offset minor.
+ * It doesn't wait, and it doesn't touch the event queue;
+ * it just brings the console's mark up to its head,
+ * and passes down whatever was new, in one catch up record.
+ * Returns 0 if there was nothing new. */
+static ssize_t addressed_read(char *buf, size_t len, int mino)
+{
+	struct acs_event mapev, lostev;
+	int culen;
+	unsigned int cup;
+	u64 stamp;
+	ssize_t rc = 0;
+	unsigned long irqflags;
+
+	raw_spin_lock_irqsave(&acslock, irqflags);
+	cb_flush(mino);
+	if (!cbuf_tty[mino] || cbuf_tty[mino]->head == cbuf_tty[mino]->mark) {
+		raw_spin_unlock_irqrestore(&acslock, irqflags);
+		return 0;
+	}
+	if (len < event_size(ACS_TTY_MAPPED)) {
+		/* no room; leave the text for next time */
+		raw_spin_unlock_irqrestore(&acslock, irqflags);
+		return -EINVAL;
+	}
+	stamp = cbuf_tty[mino]->stamp;
+	cup = cbuf_tty[mino]->head;
+	culen = cb_stage(mino, cup, &mapev, &lostev);
+	raw_spin_unlock_irqrestore(&acslock, irqflags);
+
+	if (text_mapped)
+		rc = mapped_to_user(buf, len, &mapev, &lostev);
+	else
+		rc = staged_to_user(buf, len, mino, culen, cup, stamp, &lostev);
+	if (rc <= 0) {
+		/* no room, or a bad buffer; leave the text for next time */
+		raw_spin_lock_irqsave(&acslock, irqflags);
+		cb_unstage(mino, cup);
+		raw_spin_unlock_irqrestore(&acslock, irqflags);
+		if (!rc)
+			rc = -EINVAL;
+	}
+	return rc;
+}				/* addressed_read */
+
 static ssize_t device_read(struct file *file, char *buf, size_t len,
 			   loff_t * offset)
 {
@@ -292,97 +1121,100 @@ static ssize_t device_read(struct file *file, char *buf, size_t len,
 	bool catchup_head, catchup_echo;
 /* catch up length - how many characters to copy down to user space */
 	int culen = 0;
-	unsigned int *cup = 0;	/* the catchup poin */
-	char *temp_head, *temp_tail, *t;
-	int j, j2;
+	unsigned int cup = 0;	/* the catchup point */
+	u64 custamp = 0;	/* when the catch up text was logged */
+	bool mapped = false;
+	unsigned int temp_head, temp_tail;
+	unsigned int dropped;
+	struct acs_event dropev, mapev, lostev;
+	int j;
 	int retval;
 	unsigned long irqflags;
 
 	if (!in_use)
 		return 0;	/* should never happen */
 
-	retval = wait_event_interruptible(wq, (rbuf_head > rbuf_tail));
+/* pread() at a minor number catches up that console. */
+	if (*offset > 0 && *offset <= MAX_NR_CONSOLES) {
+		mutex_lock(&staging_mutex);
+		retval = addressed_read(buf, len, *offset - 1);
+		mutex_unlock(&staging_mutex);
+		if (!retval && (file->f_flags & O_NONBLOCK))
+			retval = -EAGAIN;
+		return retval;
+	}
+
+/* A nonblocking reader drains the queue, and is told when it is empty. */
+	if ((file->f_flags & O_NONBLOCK) && rbuf_head == rbuf_tail)
+		return -EAGAIN;
+	retval = wait_event_interruptible(wq, (rbuf_head != rbuf_tail));
 	if (retval)
 		return retval;
 
+	mutex_lock(&staging_mutex);
+
 /* you can only read on behalf of the foreground console */
 	cb = cbuf_tty[fg_console];
 
-/* Use temp pointers, more keystrokes could be appended while
+	raw_spin_lock_irqsave(&acslock, irqflags);
+
+/* Log any characters that are still staged. */
+	cb_flush_all();
+
+/* Use temp indexes, more keystrokes could be appended while
  * we're doing this; that's ok. */
 	temp_head = rbuf_head;
 	temp_tail = rbuf_tail;
 
 /* Skip ahead to the last FGC event if present. */
-	for (t = temp_tail; t < temp_head; t += 4) {
-		if (*t == ACS_FGC)
-			temp_tail = t;
-		if (*t == ACS_TTY_MORECHARS)
-			t += 4;
+	if (rbuf_hasfgc) {
+		temp_tail = rbuf_fgc;
+		rbuf_hasfgc = false;
 	}
 
-	raw_spin_lock_irqsave(&acslock, irqflags);
+	dropped = rbuf_dropped;
+	rbuf_dropped = 0;
 
 	catchup = false;
 	catchup_head = false;
 	catchup_echo = false;
 
-	if ((!cb && !cb_nomem_refresh[fg_console]) ||
+	if ((!cb && cb_nomem_alloc[fg_console] == 2 &&
+	     !cb_nomem_refresh[fg_console]) ||
 	    (cb && cb->head != cb->mark)) {
 		/* MORECHARS echo 0 doesn't force us to catch up,
 		 * but anything else does.
 		 * echo forces a catch up to the echopoint.
-		 * Other commands force catch up to the head. */
-		for (t = temp_tail; t < temp_head; t += 4) {
-			if (*t == ACS_TTY_MORECHARS) {
-				t += 4;
-				if (t[-3])
-					catchup_echo = true;
-				continue;
-			}
-			catchup_head = true;
-			break;
-		}
+		 * Other commands force catch up to the head.
+		 * The producers keep track of this as they post events. */
+		catchup_head = rbuf_force;
+		catchup_echo = rbuf_echo;
 	}
+	rbuf_force = rbuf_echo = false;
 
-	if (catchup_echo && cb->echopoint)
+	if (catchup_echo && cb && cb->echoset)
 		catchup = true, cup = cb->echopoint;
 
-	if (catchup_head)
+	if (catchup_head && cb)
 		catchup = true, cup = cb->head;
 
+	if (catchup_head && !cb)
+		catchup = true;
+
+	lostev.c = 0;
+	lostev.p2 = 0;
 	if (catchup) {
 		if (cb) {
-			if (cb->mark == 0)
-				cb->mark = cb->tail;
-			if (cup >= cb->mark)
-				culen = cup - cb->mark;
-			else
-				culen =
-				    (cb->end - cb->mark) + (cup - cb->start);
+			mapped = text_mapped;
+			custamp = cb->stamp;
+			culen = cb_stage(fg_console, cup, &mapev, &lostev);
 		} else {
 			culen = sizeof(cb_nomem_message) - 1;
-		}
-
-		if (cb) {
-			/* One chunk or two. */
-			if (cup >= cb->mark) {
-				if (culen)
-					memcpy(cb_staging, cb->mark, culen * 4);
-			} else {
-				j = cb->end - cb->mark;
-				memcpy(cb_staging, cb->mark, j * 4);
-				j2 = cup - cb->start;
-				if (j2)
-					memcpy(cb_staging + j, cb->start,
-					       j2 * 4);
-			}
-			cb->mark = cup;
-			cb->echopoint = 0;
-		} else {
 			for (j = 0; j < culen; ++j)
 				cb_staging[j] = cb_nomem_message[j];
 			cb_nomem_refresh[fg_console] = 1;
+			custamp = acs_now();
+			lostev.pos = 0;
 		}
 	}
 
@@ -390,64 +1222,95 @@ static ssize_t device_read(struct file *file, char *buf, size_t len,
 
 /* Now pass down the events. */
 /* First fgc, then catch up, then the rest. */
-	if (*temp_tail == ACS_FGC && len >= 4) {
-		if (copy_to_user(buf, temp_tail, 4))
-			return -EFAULT;
-		temp_tail += 4;
-		bytes_read += 4;
-		buf += 4;
-		len -= 4;
-	}
-
-	if (catchup) {
-		cup = cb_staging;
-/* ratchet culen down to the size of the userland buffer */
-		if (culen > user_bufsize) {
-			j = culen - user_bufsize;
-			cup += j, culen -= j;
+	if (temp_tail != temp_head &&
+	    rbuf[temp_tail & rbuf_mask].cmd == ACS_FGC) {
+		j = event_to_user(buf, len, rbuf + (temp_tail & rbuf_mask));
+		if (j < 0)
+			goto fault;
+		if (j) {
+			++temp_tail;
+			bytes_read += j;
+			buf += j;
+			len -= j;
 		}
 	}
 
-	if (catchup && len >= (culen + 1) * 4) {
-		char cu_cmd[4];	/* the catch up command */
-		cu_cmd[0] = ACS_TTY_NEWCHARS;
-/* Put in the minor number here, though I don't think we need it. */
-		cu_cmd[1] = fg_console + 1;
-		cu_cmd[2] = culen;
-		cu_cmd[3] = (culen >> 8);
-		if (copy_to_user(buf, cu_cmd, 4))
-			return -EFAULT;
-
-		if (culen && copy_to_user(buf + 4, cup, culen * 4))
-			return -EFAULT;
-		bytes_read += (culen + 1) * 4;
-		buf += (culen + 1) * 4;
-		len -= (culen + 1) * 4;
+	if (mapped)
+		j = mapped_to_user(buf, len, &mapev, &lostev);
+	else if (catchup)
+		j = staged_to_user(buf, len, fg_console, culen, cup, custamp,
+				   &lostev);
+	else
+		j = 0;
+	if (j < 0)
+		goto fault;
+	if (!j && catchup && cb) {
+		/* no room; leave the text for next time */
+		raw_spin_lock_irqsave(&acslock, irqflags);
+		cb_unstage(fg_console, cup);
+		raw_spin_unlock_irqrestore(&acslock, irqflags);
+		catchup = false;
 	}
-
-/* And the rest of the events. */
-	j = temp_head - temp_tail;
-	if (j > len)
-		j = len;	/* should never happen */
-	if (j) {
-		if (copy_to_user(buf, temp_tail, j))
-			return -EFAULT;
-		temp_tail += j;
+	bytes_read += j;
+	buf += j;
+	len -= j;
+
+/* Tell user space if events were lost. */
+	if (dropped) {
+		if (dropped > 0xffff)
+			dropped = 0xffff;
+		dropev.cmd = ACS_DROPPED;
+		dropev.p1 = 0;
+		dropev.p2 = dropped;
+		dropev.p3 = (dropped >> 8);
+		dropev.pos = 0;
+		dropev.ns = acs_now();
+		j = event_to_user(buf, len, &dropev);
+		if (j < 0)
+			goto fault;
+		if (!j) {
+			/* try again next time */
+			raw_spin_lock_irqsave(&acslock, irqflags);
+			rbuf_dropped += dropped;
+			raw_spin_unlock_irqrestore(&acslock, irqflags);
+		}
+		bytes_read += j;
 		buf += j;
+		len -= j;
+	}
+
+/* And the rest of the events.
+ * The producers never write over an event that has not been read,
+ * so we can copy these down without the spinlock. */
+	while (temp_tail != temp_head) {
+		j = event_to_user(buf, len, rbuf + (temp_tail & rbuf_mask));
+		if (j < 0)
+			goto fault;
+		if (!j)
+			break;	/* should never happen */
+		++temp_tail;
 		bytes_read += j;
+		buf += j;
 		len -= j;
 	}
 
-/* Pull the pointers back to start. */
-/* This should happen almost every time. */
 	raw_spin_lock_irqsave(&acslock, irqflags);
 	rbuf_tail = temp_tail;
-	if (rbuf_head == rbuf_tail)
-		rbuf_head = rbuf_tail = rbuf;
 	raw_spin_unlock_irqrestore(&acslock, irqflags);
+	mutex_unlock(&staging_mutex);
 
-	*offset += bytes_read;
+/* The file position stays at 0; other offsets are addressed reads. */
 	return bytes_read;
+
+fault:
+/* Nothing of this read reaches user space, so the text is not caught up. */
+	if (catchup && cb) {
+		raw_spin_lock_irqsave(&acslock, irqflags);
+		cb_unstage(fg_console, cup);
+		raw_spin_unlock_irqrestore(&acslock, irqflags);
+	}
+	mutex_unlock(&staging_mutex);
+	return -EFAULT;
 }				/* device_read */
 
 static ssize_t device_write(struct file *file, const char *buf, size_t len,
@@ -459,20 +1322,54 @@ static ssize_t device_write(struct file *file, const char *buf, size_t len,
 	int nn;			/* number of notes */
 	short notes[2 * (10 + 1)];
 	int isize;		/* size of input to inject */
+	unsigned int pos;	/* where to resync */
 	int f1, f2, step, duration;	/* for kd_mksteps */
+	unsigned char metas[ACS_NUM_KEYS];
+/* The key commands in this write build one new keymap. */
+	struct keymap *km = NULL;
 	unsigned long irqflags;
 
 	if (!in_use)
 		return 0;	/* should never happen */
 
+	mutex_lock(&keymap_mutex);
+
 	while (len) {
 		get_user(c, p++);
 		len--;
 
 		switch (c) {
 		case ACS_CLEAR_KEYS:
-			clear_keys();
-			reset_meta();
+			km = keymap_edit(km);
+			if (!km)
+				break;
+			clear_keys(km);
+			reset_meta(km);
+			break;
+
+		case ACS_KEYMAP:
+			/* capture, passt, ismeta, the whole tables */
+			if (len < ACS_NUM_KEYS * 5)
+				break;
+			km = keymap_edit(km);
+			if (km &&
+			    (copy_from_user(km->capture, p, ACS_NUM_KEYS * 2) ||
+			     copy_from_user(km->passt, p + ACS_NUM_KEYS * 2,
+					    ACS_NUM_KEYS * 2) ||
+			     copy_from_user(metas, p + ACS_NUM_KEYS * 4,
+					    ACS_NUM_KEYS))) {
+				kfree(km);
+				mutex_unlock(&keymap_mutex);
+				return -EFAULT;
+			}
+			p += ACS_NUM_KEYS * 5, len -= ACS_NUM_KEYS * 5;
+			if (!km)
+				break;
+			/* the kernel meta keys, plus the ones you say */
+			reset_meta(km);
+			for (j = 0; j < ACS_NUM_KEYS; ++j)
+				if (metas[j])
+					km->ismeta[j] = metas[j];
 			break;
 
 		case ACS_SET_KEY:
@@ -483,16 +1380,16 @@ static ssize_t device_write(struct file *file, const char *buf, size_t len,
 			len--;
 			get_user(shiftstate, p++);
 			len--;
-			if (key < ACS_NUM_KEYS) {
+			if (key < ACS_NUM_KEYS && (km = keymap_edit(km))) {
 				teebit = (shiftstate & ACS_KEY_T);
 				shiftstate &= 0xf;
-				capture[key] |=
+				km->capture[key] |=
 				    (1 << shiftstate);
 				if(teebit)
-					passt[key] |=
+					km->passt[key] |=
 					    (1 << shiftstate);
 				else
-					passt[key] &=
+					km->passt[key] &=
 					    ~(1 << shiftstate);
 			}
 			break;
@@ -505,10 +1402,10 @@ static ssize_t device_write(struct file *file, const char *buf, size_t len,
 			len--;
 			get_user(shiftstate, p++);
 			len--;
-			if (key < ACS_NUM_KEYS) {
-				passt[key] = 0;
+			if (key < ACS_NUM_KEYS && (km = keymap_edit(km))) {
+				km->passt[key] = 0;
 				shiftstate &= 0xf;
-				capture[key] &=
+				km->capture[key] &=
 				    ~((unsigned short)1 << shiftstate);
 			}
 			break;
@@ -521,8 +1418,8 @@ static ssize_t device_write(struct file *file, const char *buf, size_t len,
 			len--;
 			get_user(c, p++);
 			len--;
-			if (key < ACS_NUM_KEYS)
-				ismeta[key] = (unsigned char)c;
+			if (key < ACS_NUM_KEYS && (km = keymap_edit(km)))
+				km->ismeta[key] = (unsigned char)c;
 			break;
 
 		case ACS_CLICK:
@@ -637,12 +1534,7 @@ static ssize_t device_write(struct file *file, const char *buf, size_t len,
 
 		case ACS_REFRESH:
 			raw_spin_lock_irqsave(&acslock, irqflags);
-			if (rbuf_head <= rbuf_end - 4) {
-				*rbuf_head = ACS_REFRESH;
-				if (rbuf_head == rbuf_tail)
-					wake_up_interruptible(&wq);
-				rbuf_head += 4;
-			}
+			rbuf_post(ACS_REFRESH, 0, 0, 0, 0);
 			raw_spin_unlock_irqrestore(&acslock, irqflags);
 			break;
 
@@ -675,26 +1567,201 @@ static ssize_t device_write(struct file *file, const char *buf, size_t len,
 			user_bufsize = isize;
 			break;
 
+		case ACS_RINGSIZE:
+			if (len < 2)
+				break;
+			get_user(c, p++);
+			j = (unsigned char)c;
+			get_user(c, p++);
+			len -= 2;
+			isize = (unsigned char)c;
+			if (isize < PAGE_SHIFT)
+				isize = PAGE_SHIFT;
+			if (isize > CB_MAX_SHIFT)
+				isize = CB_MAX_SHIFT;
+			isize = 1 << isize;
+			if (j > MAX_NR_CONSOLES)
+				break;
+			if (j) {
+				cb_resize(j - 1, isize);
+				break;
+			}
+			/* all consoles, and the ones to come */
+			ringsize = isize;
+			for (j = 0; j < MAX_NR_CONSOLES; ++j)
+				cb_resize(j, isize);
+			break;
+
+		case ACS_TIMESTAMPS:
+			if (len < 1)
+				break;
+			get_user(c, p++);
+			len--;
+			stamp_events = (c != 0);
+			break;
+
+		case ACS_COMPACT:
+			if (len < 1)
+				break;
+			get_user(c, p++);
+			len--;
+			compact_text = (c != 0);
+			break;
+
+		case ACS_PROTOCOL:
+			if (len < 1)
+				break;
+			get_user(c, p++);
+			len--;
+			mutex_lock(&staging_mutex);
+			protocol = (c == 2 ? 2 : 1);
+			mutex_unlock(&staging_mutex);
+			break;
+
+		case ACS_RESYNC:
+			if (len < 5)
+				break;
+			get_user(c, p++);
+			j = (unsigned char)c;
+			if (copy_from_user(&pos, p, 4))
+				break;
+			p += 4, len -= 5;
+			if (j < 1 || j > MAX_NR_CONSOLES)
+				break;
+			raw_spin_lock_irqsave(&acslock, irqflags);
+			cb_resync(j - 1, pos);
+			raw_spin_unlock_irqrestore(&acslock, irqflags);
+			break;
+
 		}		/* switch */
 	}			/* loop processing config instructions */
 
+	keymap_publish(km);
+	mutex_unlock(&keymap_mutex);
+
+/* Leave the file offset at 0; it is shared with read(),
+ * where other offsets are addressed reads. */
 	bytes_write = p - buf;
-	*offset += bytes_write;
 	return bytes_write;
 }				/* device_write */
 
 static unsigned int device_poll(struct file *fp, poll_table * pt)
 {
-	unsigned int mask = 0;
+/* Commands are taken as they come, and a write never blocks,
+ * so the device is always writable. */
+	unsigned int mask = POLLOUT | POLLWRNORM;
 	if (!in_use)
 		return 0;	/* should never happen */
-/* we don't support poll writing. How to figure if the buffer is not full? */
-	if (rbuf_head > rbuf_tail)
-		mask = POLLIN | POLLRDNORM;
 	poll_wait(fp, &wq, pt);
+	if (rbuf_head != rbuf_tail)
+		mask |= POLLIN | POLLRDNORM;
 	return mask;
 }
 
+/* Map the console rings into user space, read only.
+ * Pages are supplied on demand by the fault handler;
+ * a console that has no ring yet gives you SIGBUS. */
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(4, 17, 0)
+typedef int vm_fault_t;
+#endif
+
+/* Put a page of a ring into the page table ourselves, under ring_sem,
+ * rather than hand it back in vmf->page.  The kernel would install that
+ * after we return, perhaps after a resize has freed the ring and run
+ * unmap_mapping_range(), and the mapping would keep the stale page. */
+static vm_fault_t acs_insert_page(struct vm_area_struct *vma,
+				  unsigned long addr, struct page *page)
+{
+#if LINUX_VERSION_CODE < KERNEL_VERSION(4, 20, 0)
+	int err = vm_insert_page(vma, addr, page);
+	if (!err || err == -EBUSY)
+		return VM_FAULT_NOPAGE;
+	return (err == -ENOMEM ? VM_FAULT_OOM : VM_FAULT_SIGBUS);
+#else
+	return vmf_insert_page(vma, addr, page);
+#endif
+}
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(4, 11, 0)
+static vm_fault_t acs_vm_fault(struct vm_area_struct *vma,
+			       struct vm_fault *vmf)
+#else
+static vm_fault_t acs_vm_fault(struct vm_fault *vmf)
+#endif
+{
+	unsigned long pgoff = vmf->pgoff;
+	unsigned long slotpages = CB_MAX / PAGE_SIZE;
+	unsigned long off;
+	int mino;
+	struct cbuf *cb;
+	struct page *page;
+	unsigned long irqflags;
+	vm_fault_t rc;
+#if LINUX_VERSION_CODE < KERNEL_VERSION(4, 11, 0)
+	unsigned long addr = (unsigned long)vmf->virtual_address;
+#else
+	struct vm_area_struct *vma = vmf->vma;
+	unsigned long addr = vmf->address;
+#endif
+
+	if (pgoff == 0) {
+		page = vmalloc_to_page(mmhdr);
+	} else {
+		--pgoff;
+		mino = pgoff / slotpages;
+		off = (pgoff % slotpages) * PAGE_SIZE;
+		if (mino >= MAX_NR_CONSOLES)
+			return VM_FAULT_SIGBUS;
+/* Hold ring_sem until the page is installed,
+ * so a resize can't free the ring and unmap it in between;
+ * cb_resize() takes it for writing around the swap and the unmap. */
+		down_read(&ring_sem);
+		raw_spin_lock_irqsave(&acslock, irqflags);
+		cb = cbuf_tty[mino];
+		if (!cb || off >= cb->size) {
+			raw_spin_unlock_irqrestore(&acslock, irqflags);
+			up_read(&ring_sem);
+			return VM_FAULT_SIGBUS;
+		}
+		page = vmalloc_to_page(cb->area + off);
+		raw_spin_unlock_irqrestore(&acslock, irqflags);
+		rc = acs_insert_page(vma, addr, page);
+		up_read(&ring_sem);
+		return rc;
+	}
+
+	get_page(page);
+	vmf->page = page;
+	return 0;
+}				/* acs_vm_fault */
+
+static const struct vm_operations_struct acs_vm_ops = {
+	.fault = acs_vm_fault,
+};
+
+static int device_mmap(struct file *file, struct vm_area_struct *vma)
+{
+	if (!in_use)
+		return -ENXIO;	/* should never happen */
+	if (vma->vm_flags & VM_WRITE)
+		return -EPERM;
+/* Mixed map, so the fault handler can insert ring pages itself. */
+#if LINUX_VERSION_CODE < KERNEL_VERSION(6, 3, 0)
+	vma->vm_flags &= ~VM_MAYWRITE;
+	vma->vm_flags |= VM_MIXEDMAP;
+#else
+	vm_flags_clear(vma, VM_MAYWRITE);
+	vm_flags_set(vma, VM_MIXEDMAP);
+#endif
+	vma->vm_ops = &acs_vm_ops;
+	acs_mapping = file->f_mapping;
+/* From here on, catch up events tell user space where the new text is,
+ * rather than copying it down. */
+	text_mapped = true;
+	return 0;
+}				/* device_mmap */
+
 static const struct file_operations fops = {
 	.owner = THIS_MODULE,
 	.open = device_open,
@@ -702,6 +1769,8 @@ static const struct file_operations fops = {
 	.read = device_read,
 	.write = device_write,
 	.poll = device_poll,
+	.fasync = device_fasync,
+	.mmap = device_mmap,
 };
 
 static struct miscdevice acsint_dev = {
@@ -916,26 +1985,22 @@ static void post4echo(int keytype, struct keyboard_notifier_param *param)
 	raw_spin_unlock_irqrestore(&acslock, irqflags);
 }				/* post4echo */
 
-/* Push a character onto the tty log.
- * Called from the vt notifyer and from my printk console. */
-static void pushlog(unsigned int c, int mino, bool from_vt)
+/* Push a character onto the tty log, and throw MORECHARS if need be.
+ * This is run from within a spinlock, by cb_flush(). */
+static void cb_log(struct cbuf *cb, int mino, unsigned int c)
 {
-	unsigned long irqflags;
-	bool wake = false;
 	bool at_head = false;	/* output is at the head */
 	bool throw = false;	/* throw the MORECHARS event */
+	bool from_vt = !(c & CB_KMSG);
 	int echo = 0;
-	struct cbuf *cb = cbuf_tty[mino];
-
-	if (!cb)
-		return;
 
-	raw_spin_lock_irqsave(&acslock, irqflags);
+	c &= ~CB_KMSG;
 
 	if (mino == fg_console) {
 		if (from_vt)
 			echo = isEcho(c);
-		if (cb->mark == cb->head || cb->echopoint == cb->head)
+		if (cb->mark == cb->head ||
+		    (cb->echoset && cb->echopoint == cb->head))
 			at_head = true;
 		if (at_head || echo)
 			throw = true;
@@ -952,21 +2017,83 @@ static void pushlog(unsigned int c, int mino, bool from_vt)
 
 	cb_append(cb, c);
 
-	if (throw && rbuf_head <= rbuf_end - 8) {
-		/* throw the MORECHARS event */
-		if (rbuf_head == rbuf_tail)
-			wake = true;
-		rbuf_head[0] = ACS_TTY_MORECHARS;
-		rbuf_head[1] = echo;
-			*(unsigned int *)(rbuf_head + 4) = c;
-		rbuf_head += 8;
-		if (echo)
-			cb->echopoint = cb->head;
+	/* throw the MORECHARS event */
+	if (throw && rbuf_post(ACS_TTY_MORECHARS, echo, 0, 0, c) && echo) {
+		cb->echopoint = cb->head;
+		cb->echoset = true;
 	}
+}				/* cb_log */
+
+/* Move the staged characters of a console onto its tty log.
+ * This is run from within a spinlock.
+ * Only the first character of a burst is at the head,
+ * so a whole batch of output throws at most one MORECHARS event,
+ * unless some of it is echo. */
+static void cb_flush(int mino)
+{
+	struct cbuf *cb = cbuf_tty[mino];
+	unsigned int head, tail;
 
-	if (wake)
-		wake_up_interruptible(&wq);
+	if (!cb)
+		return;
+	head = READ_ONCE(cb->stage_head);
+	tail = cb->stage_tail;
+	if (head == tail)
+		return;
+	smp_rmb();
+	while (tail != head)
+		cb_log(cb, mino, cb->stage[tail++ & (CB_STAGE - 1)]);
+	cb->stamp = acs_now();
+	smp_mb();
+	WRITE_ONCE(cb->stage_tail, tail);
+	cb_publish(cb, mino);
+}				/* cb_flush */
+
+static void cb_flush_all(void)
+{
+	int j;
+
+	for (j = 0; j < MAX_NR_CONSOLES; ++j)
+		cb_flush(j);
+}				/* cb_flush_all */
+
+static void stage_flush(struct irq_work *work)
+{
+	unsigned long irqflags;
+
+	raw_spin_lock_irqsave(&acslock, irqflags);
+	cb_flush_all();
 	raw_spin_unlock_irqrestore(&acslock, irqflags);
+}				/* stage_flush */
+
+static struct irq_work stage_work;
+
+/* Stage a character for the tty log.
+ * Called from the vt notifier and from my printk console,
+ * both of which run under the console lock,
+ * so there is only one of us at a time.
+ * No spinlock here; the flush is left to irq_work. */
+static void pushlog(unsigned int c, int mino, bool from_vt)
+{
+	struct cbuf *cb = cbuf_tty[mino];
+	unsigned long irqflags;
+	unsigned int head;
+
+	if (!cb)
+		return;
+
+	head = cb->stage_head;
+	if (head - READ_ONCE(cb->stage_tail) == CB_STAGE) {
+		/* staging area is full, flush it now */
+		raw_spin_lock_irqsave(&acslock, irqflags);
+		cb_flush(mino);
+		raw_spin_unlock_irqrestore(&acslock, irqflags);
+	}
+
+	cb->stage[head & (CB_STAGE - 1)] = (from_vt ? c : c | CB_KMSG);
+	smp_wmb();
+	WRITE_ONCE(cb->stage_head, head + 1);
+	irq_work_queue(&stage_work);
 }				/* pushlog */
 
 /*
@@ -1002,7 +2129,6 @@ vt_out(struct notifier_block *this_nb, unsigned long type, void *data)
 	int mino = vc->vc_num;
 	unsigned int unicode = param->c;
 	unsigned long irqflags;
-	bool wake = false;
 
 	if (!in_use)
 		return NOTIFY_DONE;
@@ -1021,15 +2147,9 @@ vt_out(struct notifier_block *this_nb, unsigned long type, void *data)
 		last_oj = 0;
 		raw_spin_lock_irqsave(&acslock, irqflags);
 		flushInKeyBuffer();
-		if (rbuf_head <= rbuf_end - 4) {
-			if (rbuf_head == rbuf_tail)
-				wake = true;
-			rbuf_head[0] = ACS_FGC;
-			rbuf_head[1] = fg_console + 1;
-			rbuf_head += 4;
-			if (wake)
-				wake_up_interruptible(&wq);
-		}
+		/* output before the switch belongs to the old console */
+		cb_flush_all();
+		rbuf_post(ACS_FGC, fg_console + 1, 0, 0, 0);
 		raw_spin_unlock_irqrestore(&acslock, irqflags);
 		break;
 
@@ -1060,8 +2180,9 @@ keystroke(struct notifier_block *this_nb, unsigned long type, void *data)
 	int mymeta, mymask;
 	int j;
 	unsigned short action;
-	bool wake = false, keep = false, send = false;
+	bool keep = false, send = false;
 	bool divert, monitor, bypass;
+	struct keymap *km;
 	unsigned long irqflags;
 
 	if (!in_use)
@@ -1079,8 +2200,12 @@ keystroke(struct notifier_block *this_nb, unsigned long type, void *data)
 	if (type != KBD_KEYCODE)
 		goto done;
 
+	rcu_read_lock();
+	km = rcu_dereference(keymap);
+
 /* Capture and process keys that are meta, but not kernel meta */
-	if(key < ACS_NUM_KEYS && (mymeta = ismeta[key]) && mymeta != ACS_SS_KERNEL) {
+	if(key < ACS_NUM_KEYS && (mymeta = km->ismeta[key]) && mymeta != ACS_SS_KERNEL) {
+		rcu_read_unlock();
 		mymask = 1;
 		for(j=0; j<4; ++j, mymask<<=1)
 			if(mymask & mymeta)
@@ -1089,8 +2214,10 @@ keystroke(struct notifier_block *this_nb, unsigned long type, void *data)
 	}
 
 /* Only the key down events */
-	if (downflag == 0)
+	if (downflag == 0) {
+		rcu_read_unlock();
 		goto done;
+	}
 
 	ss &= 0xf;
 /* Adjust by the user meta keys. */
@@ -1102,14 +2229,14 @@ keystroke(struct notifier_block *this_nb, unsigned long type, void *data)
 
 	action = 0;
 	if (key < ACS_NUM_KEYS)
-		action = capture[key];
+		action = km->capture[key];
 
 	divert = key_divert;
 	monitor = key_monitor;
 	bypass = key_bypass;
 /* But we don't redirect the meta keys */
 	if (divert || monitor || bypass) {
-		if (key < ACS_NUM_KEYS && ismeta[key]) {
+		if (key < ACS_NUM_KEYS && km->ismeta[key]) {
 			divert = false;
 			monitor = false;
 			bypass = false;
@@ -1133,7 +2260,7 @@ keystroke(struct notifier_block *this_nb, unsigned long type, void *data)
 
 	if (action & (1 << ss)) {
 		keep = true;
-		if(passt[key] & (1<<ss))
+		if(km->passt[key] & (1<<ss))
 			send = true;
 		goto event;
 	}
@@ -1144,20 +2271,12 @@ regular:
 		send = true;
 
 event:
+	rcu_read_unlock();
+
 	if (keep) {
 		/* If this notifier is not called by an interrupt, then we need the spinlock */
 		raw_spin_lock_irqsave(&acslock, irqflags);
-		if (rbuf_head <= rbuf_end - 4) {
-			if (rbuf_head == rbuf_tail)
-				wake = true;
-			rbuf_head[0] = ACS_KEYSTROKE;
-			rbuf_head[1] = key;
-			rbuf_head[2] = ss;
-			rbuf_head[3] = param->ledstate;
-			rbuf_head += 4;
-			if (wake)
-				wake_up_interruptible(&wq);
-		}
+		rbuf_post(ACS_KEYSTROKE, key, ss, param->ledstate, 0);
 		raw_spin_unlock_irqrestore(&acslock, irqflags);
 	}
 
@@ -1183,14 +2302,42 @@ static int __init acsint_init(void)
 	int rc;
 
 	in_use = false;
-	clear_keys();
+	reset_meta(&keymap0);
+
+	if (ringsize < PAGE_SIZE)
+		ringsize = PAGE_SIZE;
+	if (ringsize > CB_MAX)
+		ringsize = CB_MAX;
+	ringsize = roundup_pow_of_two(ringsize);
+
+	if (rbufsize < 16)
+		rbufsize = 16;
+	if (rbufsize > 65536)
+		rbufsize = 65536;
+	rbufsize = roundup_pow_of_two(rbufsize);
+	rbuf = kmalloc(rbufsize * sizeof(struct acs_event), GFP_KERNEL);
+	if (!rbuf)
+		return -ENOMEM;
+	rbuf_mask = rbufsize - 1;
+	rbuf_reset();
+
+	mmhdr = vmalloc_user(PAGE_SIZE);
+	if (!mmhdr) {
+		kfree(rbuf);
+		return -ENOMEM;
+	}
+	mmhdr->ringsize = CB_MAX;
+	init_irq_work(&stage_work, stage_flush);
 
 	if (major == 0)
 		rc = misc_register(&acsint_dev);
 	else
 		rc = register_chrdev(major, ACS_DEVICE, &fops);
-	if (rc)
+	if (rc) {
+		kfree(rbuf);
+		vfree(mmhdr);
 		return rc;
+	}
 	if (major == 0)
 		printk(KERN_NOTICE "registered acsint, major %d minor %d\n",
 		       MISC_MAJOR, acsint_dev.minor);
@@ -1201,6 +2348,8 @@ static int __init acsint_init(void)
 			misc_deregister(&acsint_dev);
 		else
 			unregister_chrdev(major, ACS_DEVICE);
+		kfree(rbuf);
+		vfree(mmhdr);
 		return rc;
 	}
 
@@ -1211,6 +2360,8 @@ static int __init acsint_init(void)
 			misc_deregister(&acsint_dev);
 		else
 			unregister_chrdev(major, ACS_DEVICE);
+		kfree(rbuf);
+		vfree(mmhdr);
 		return rc;
 	}
 
@@ -1231,8 +2382,18 @@ static void __exit acsint_exit(void)
 	else
 		unregister_chrdev(major, ACS_DEVICE);
 
-	for (j = 0; j < MAX_NR_CONSOLES; ++j)
+	irq_work_sync(&stage_work);
+	cancel_work_sync(&alloc_work);
+	for (j = 0; j < MAX_NR_CONSOLES; ++j) {
+		if (!cbuf_tty[j])
+			continue;
+		vfree(cbuf_tty[j]->area);
 		kfree(cbuf_tty[j]);
+	}
+	kfree(rbuf);
+	vfree(mmhdr);
+	if (rcu_access_pointer(keymap) != &keymap0)
+		kfree(rcu_access_pointer(keymap));
 }
 
 module_init(acsint_init);
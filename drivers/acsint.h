@@ -6,6 +6,7 @@
 #include <linux/input.h>
 #include <linux/kd.h>
 #include <linux/keyboard.h>
+#include <linux/vt.h>
 
 /* Commands that Acsint sends or receives */
 enum acs_command {
@@ -41,8 +42,22 @@ enum acs_command {
 	ACS_TTY_MORECHARS,	/* there are more chars pending */
 	ACS_FGC,		/* foreground console */
 	ACS_PRINTK,
+	ACS_DROPPED,		/* events lost because the queue was full */
+	ACS_TTY_MAPPED,		/* new chars are in the mapped ring */
+	ACS_COMPACT,		/* send new chars in utf8 */
+	ACS_TTY_NEWUTF8,	/* new chars, in utf8 */
+	ACS_RINGSIZE,		/* size of the kernel tty log */
+	ACS_TIMESTAMPS,		/* put the time on each event */
+	ACS_KEYMAP,		/* all the key tables at once */
+	ACS_PROTOCOL,		/* version of the event framing */
+	ACS_OVERRUN,		/* tty text lost before you saw it */
+	ACS_RESYNC,		/* send the tty text again from here */
 };
 
+/* Why text was lost, in p2 of the overrun event. */
+#define ACS_LOST_OVERWRITTEN 1	/* ran out the back of the kernel log */
+#define ACS_LOST_TOOLONG 2	/* trimmed to fit the catch up */
+
 /* Here is a bound; you can't capture keys at or beyond this point. */
 #define ACS_NUM_KEYS 128
 
@@ -62,4 +77,28 @@ enum acs_command {
 
 #define ACS_KEY_T 0x20
 
+/* Layout of the memory you get when you mmap /dev/acsint.
+ * The first page is this header.
+ * The ring of utf8 text for console n, minor number n+1,
+ * starts at byte offset pagesize + n * ringsize,
+ * and is con[n].size bytes long, which can change at any time.
+ * Positions are byte counts that run freely, and are taken modulo size.
+ * The oldest characters are dropped whole, but a reader that trails
+ * the tail could land in the middle of one; skip continuation bytes.
+ * head is stored after the characters it covers,
+ * and seq is odd while a ring is being reset or resized. */
+struct acs_mmap_console {
+	unsigned int seq;
+	unsigned int size;	/* 0 if the ring is not yet allocated */
+	unsigned int head;	/* count of bytes logged */
+	unsigned int mark;	/* where the last catch up left off */
+	unsigned int gen;	/* bumped each time the ring is reset */
+};
+
+struct acs_mmap_header {
+	unsigned int ringsize;	/* bytes from one ring to the next */
+	unsigned int reserved[3];
+	struct acs_mmap_console con[MAX_NR_CONSOLES];
+};
+
 #endif
@@ -15,8 +15,11 @@
 #include <linux/console.h>
 #include <linux/module.h>
 #include <linux/io.h>		/* for inb() outb() */
-#include <linux/delay.h>
+#include <linux/hrtimer.h>
+#include <linux/ktime.h>
 #include <linux/i8253.h>
+#include <linux/slab.h>
+#include <linux/log2.h>
 
 #include "ttyclicks.h"
 
@@ -47,7 +50,12 @@ MODULE_PARM_DESC(kmsg,
 
 static int sleep;
 module_param(sleep, int, 0);
-MODULE_PARM_DESC(sleep, "sleep between the clicks of the output characters - not yet implemented.");
+MODULE_PARM_DESC(sleep, "no longer used; the clicks never hold up the console.");
+
+static int fifodepth = 256;
+module_param(fifodepth, int, 0);
+MODULE_PARM_DESC(fifodepth,
+		 "number of notes the sound fifo can hold, rounded up to a power of 2, default = 256");
 
 /*
  * Here are some symbols that we export to other modules
@@ -82,6 +90,10 @@ static char escState;
  * I make a sound with up and down tones.
  */
 
+/* classes of sounds, in order of priority; see the sound fifo below */
+enum { SF_CHIRP, SF_NORMAL, SF_ALERT };
+static void my_mknotes(const short *p, int class);
+
 static const short printk_sound[] = {
 	730, 7, 760, 7, 790, 7, 760, 7, 730, 7, -1, 7, 0, 0
 };
@@ -92,7 +104,7 @@ static void my_printk(struct console *cons, const char *msg, unsigned int len)
 	while (len--) {
 		c = *msg++;
 		if (c == '\n' && ttyclicks_on & ttyclicks_kmsg)
-			ttyclicks_notes(printk_sound);
+			my_mknotes(printk_sound, SF_ALERT);
 	}
 }				/* my_printk */
 
@@ -217,6 +229,8 @@ static struct notifier_block nb_key = {
 /* intervals measured in microseconds */
 #define TICKS_CLICK 600
 #define TICKS_CHARWAIT 4000
+/* the shortest rest between clicks, when output is pouring out */
+#define TICKS_MINREST 150
 
 /* Use the global PIT lock ! */
 
@@ -256,16 +270,99 @@ static void speaker_sing(unsigned int freq)
 	raw_spin_unlock_irqrestore(&i8253_lock, flags);
 }
 
-static void my_mksteps(int f1, int f2, int step, int duration);
+static void my_mksteps(int f1, int f2, int step, int duration, int class);
+
+/*
+ * The clicks used to be timed with udelay, right in the vt notifier,
+ * which held the console to 250 characters a second,
+ * and burned a cpu the whole time.
+ * Now each character puts a token on a queue, and returns at once.
+ * An hrtimer plays the tokens out: a 600 microsecond pulse,
+ * then a rest of up to 3400 microseconds, the old teletype rhythm.
+ * If output comes faster than that, the queue backs up,
+ * and the rests get shorter in proportion,
+ * until the clicks run together into a burst, a sort of buzz,
+ * whose density tells you how fast the text is flying by.
+ * Once the queue is full, further tokens are dropped;
+ * the burst can't get any denser.
+ * A space, or any other nonprinting character, is a silent beat.
+ */
+
+#define CLICK_QLEN 64		/* a power of 2 */
+#define CLICK_EASE 4		/* backlog that halves the rest */
+static unsigned char click_q[CLICK_QLEN];	/* 1 click, 0 silent beat */
+static unsigned int click_head, click_tail;
+static bool click_busy;		/* timer is running */
+static bool click_down;		/* in the middle of a pulse */
+static unsigned int click_rest;	/* rest after this pulse */
+static DEFINE_RAW_SPINLOCK(click_lock);
+static struct hrtimer click_timer;
+
+static enum hrtimer_restart click_tick(struct hrtimer *t)
+{
+	unsigned long flags;
+	unsigned int backlog;
+	unsigned char what;
+
+	if (click_down) {
+		/* end of the pulse */
+		speaker_toggle();
+		click_down = false;
+		hrtimer_forward_now(t, ns_to_ktime(click_rest * NSEC_PER_USEC));
+		return HRTIMER_RESTART;
+	}
+
+	raw_spin_lock_irqsave(&click_lock, flags);
+	if (click_head == click_tail || !ttyclicks_on) {
+		click_tail = click_head;
+		click_busy = false;
+		raw_spin_unlock_irqrestore(&click_lock, flags);
+		return HRTIMER_NORESTART;
+	}
+	what = click_q[click_tail++ & (CLICK_QLEN - 1)];
+	backlog = click_head - click_tail;
+	raw_spin_unlock_irqrestore(&click_lock, flags);
+
+	click_rest = (TICKS_CHARWAIT - TICKS_CLICK) * CLICK_EASE /
+	    (CLICK_EASE + backlog);
+	if (click_rest < TICKS_MINREST)
+		click_rest = TICKS_MINREST;
+
+	if (what) {
+		speaker_toggle();
+		click_down = true;
+		hrtimer_forward_now(t, ns_to_ktime(TICKS_CLICK * NSEC_PER_USEC));
+	} else {
+		hrtimer_forward_now(t,
+				    ns_to_ktime((TICKS_CLICK + click_rest) *
+						NSEC_PER_USEC));
+	}
+	return HRTIMER_RESTART;
+}				/* click_tick */
+
+/* Put a click, or a silent beat, on the queue. */
+static void click_push(unsigned char what)
+{
+	unsigned long flags;
+	bool start = false;
+
+	raw_spin_lock_irqsave(&click_lock, flags);
+	if (click_head - click_tail < CLICK_QLEN)
+		click_q[click_head++ & (CLICK_QLEN - 1)] = what;
+	if (!click_busy)
+		click_busy = start = true;
+	raw_spin_unlock_irqrestore(&click_lock, flags);
+
+	if (start)
+		hrtimer_start(&click_timer, ktime_set(0, 0), HRTIMER_MODE_REL);
+}				/* click_push */
 
 /* the sound of a character click */
 void ttyclicks_click(void)
 {
 	if (!ttyclicks_on)
 		return;
-	speaker_toggle();
-	udelay(TICKS_CLICK);
-	speaker_toggle();
+	click_push(1);
 }				/* ttyclicks_click */
 EXPORT_SYMBOL_GPL(ttyclicks_click);
 
@@ -273,12 +370,12 @@ void ttyclicks_cr(void)
 {
 	if (!ttyclicks_on)
 		return;
-	my_mksteps(2900, 3600, 10, 10);
+	my_mksteps(2900, 3600, 10, 10, SF_CHIRP);
 }				/* ttyclicks_cr */
 EXPORT_SYMBOL_GPL(ttyclicks_cr);
 
 /*
- * Push notes onto a sound fifo and play them via an asynchronous thread.
+ * Push notes onto a sound fifo and play them via an hrtimer.
  * This is particularly helpful when the adapter is not working,
  * for whatever reason.  These functions are central to the kernel,
  * and do not depend on sound cards, loadable modules, etc.
@@ -288,119 +385,169 @@ EXPORT_SYMBOL_GPL(ttyclicks_cr);
  * and the second is the duration in hundredths of a second.
  * A frequency of -1 is a rest.
  * A frequency of 0 ends the list of notes.
+ *
+ * Notes are timed in microseconds, so a sweep sounds the same
+ * whatever HZ the kernel was built with.
+ * Each sequence of notes belongs to a class.
+ * A chirp, like the newline swoop, is only worth hearing right away;
+ * if it has waited more than SF_STALE it is skipped,
+ * and it gives way when something else needs the room.
+ * An alert, like the kernel message tones, flushes everything else,
+ * and cuts off the note that is sounding.
+ * A sequence goes on the fifo whole, or not at all.
  */
 
-#define SF_LEN 64		/* length of sound fifo */
-static short sf_fifo[SF_LEN];
-static int sf_head, sf_tail;
-static DEFINE_RAW_SPINLOCK(soundfifo_lock);
+#define SF_STALE 250		/* milliseconds */
 
-/* Pop the next sound out of the sound fifo. */
-static void pop_soundfifo(unsigned long);
+struct sf_note {
+	short freq;
+	unsigned char class;
+	unsigned int usecs;
+	ktime_t stale;		/* skip a chirp that is still here at this time */
+};
 
-static DEFINE_TIMER(kd_mknotes_timer, pop_soundfifo, 0, 0);
+static struct sf_note *sf_fifo;
+static unsigned int sf_mask, sf_head, sf_tail;
+static bool sf_busy;		/* timer is running */
+static DEFINE_RAW_SPINLOCK(soundfifo_lock);
+static struct hrtimer sf_timer;
 
-static void pop_soundfifo(unsigned long notUsed)
+/* Pop the next sound out of the sound fifo. */
+static enum hrtimer_restart pop_soundfifo(struct hrtimer *t)
 {
 	unsigned long flags;
-	int freq, duration;
-	int i;
-	long jifpause;
+	struct sf_note *n;
+	ktime_t now = ktime_get();
+	unsigned int usecs;
 
 	raw_spin_lock_irqsave(&soundfifo_lock, flags);
 
-	i = sf_tail;
-	if (i == sf_head) {
-		freq = 0;
-		duration = 0;
-	} else {
-		freq = sf_fifo[i];
-		duration = sf_fifo[i + 1];
-		i += 2;
-		if (i == SF_LEN)
-			i = 0;
-		sf_tail = i;
+	/* The chirps that waited too long are no use now. */
+	while (sf_tail != sf_head) {
+		n = sf_fifo + (sf_tail & sf_mask);
+		if (n->class != SF_CHIRP ||
+		    ktime_to_ns(ktime_sub(now, n->stale)) < 0)
+			break;
+		++sf_tail;
 	}
 
-	raw_spin_unlock_irqrestore(&soundfifo_lock, flags);
-
-	if (freq == 0) {
+	if (sf_tail == sf_head) {
 		/* turn off singing speaker */
 		speaker_sing(0);
-		del_timer(&kd_mknotes_timer);
-		return;
+		sf_busy = false;
+		raw_spin_unlock_irqrestore(&soundfifo_lock, flags);
+		return HRTIMER_NORESTART;
 	}
 
-	jifpause = msecs_to_jiffies(duration);
-	/* not sure of the rounding, if duration < HZ */
-	if (jifpause == 0)
-		jifpause = 1;
-	mod_timer(&kd_mknotes_timer, jiffies + jifpause);
+	n = sf_fifo + (sf_tail++ & sf_mask);
+	/* a rest between notes is a frequency of -1 */
+	speaker_sing(n->freq > 0 ? n->freq : 0);
+	usecs = n->usecs;
 
-	if (freq < 0) {
-		/* This is a rest between notes */
-		speaker_sing(0);
-	} else {
-		speaker_sing(freq);
-	}
+	raw_spin_unlock_irqrestore(&soundfifo_lock, flags);
+
+	hrtimer_forward_now(t, ns_to_ktime((u64)usecs * NSEC_PER_USEC));
+	return HRTIMER_RESTART;
+}
+
+/* Drop the queued notes below a class.  This is under the lock. */
+static void sf_purge(int class)
+{
+	unsigned int i, j = sf_tail;
+
+	for (i = sf_tail; i != sf_head; ++i)
+		if (sf_fifo[i & sf_mask].class >= class)
+			sf_fifo[j++ & sf_mask] = sf_fifo[i & sf_mask];
+	sf_head = j;
+}
+
+/* Make room for n notes of a class.  This is under the lock. */
+static bool sf_room(unsigned int n, int class)
+{
+	if (class == SF_ALERT)
+		sf_purge(SF_ALERT);
+	if (sf_head - sf_tail + n > sf_mask + 1)
+		sf_purge(SF_NORMAL);	/* old chirps give way */
+	return sf_head - sf_tail + n <= sf_mask + 1;
+}
+
+/* Put one note on the fifo, after sf_room() has made space.
+ * when is the time it should start, if there is no waiting. */
+static void sf_put(int freq, unsigned int usecs, int class, ktime_t *when)
+{
+	struct sf_note *n = sf_fifo + (sf_head++ & sf_mask);
+
+	n->freq = freq;
+	n->usecs = usecs;
+	n->class = class;
+	n->stale = ktime_add_ns(*when, SF_STALE * NSEC_PER_MSEC);
+	*when = ktime_add_us(*when, usecs);
+}
+
+/* Start the timer if it isn't running,
+ * or cut off the current note if an alert has arrived. */
+static void sf_kick(bool start, int class)
+{
+	if (start ||
+	    (class == SF_ALERT && hrtimer_try_to_cancel(&sf_timer) == 1))
+		hrtimer_start(&sf_timer, ktime_set(0, 0), HRTIMER_MODE_REL);
 }
 
 /* Push a string of notes into the sound fifo. */
-static void my_mknotes(const short *p)
+static void my_mknotes(const short *p, int class)
 {
-	int i;
-	bool wake = false;
+	const short *q;
+	unsigned int n = 1;	/* the rest at the end */
+	bool start = false;
 	unsigned long flags;
+	ktime_t when = ktime_get();
 
 	if (*p == 0)
 		return;		/* empty list */
+	for (q = p; *q; q += 2)
+		++n;
 
 	raw_spin_lock_irqsave(&soundfifo_lock, flags);
 
-	i = sf_head;
-	if (i == sf_tail)
-		wake = true;
-
-	/* Copy shorts into the fifo, until the terminating zero. */
-	while (*p) {
-		sf_fifo[i++] = *p++;
-		sf_fifo[i++] = (*p++) * 10;
-		if (i == SF_LEN)
-			i = 0;	/* wrap around */
-		if (i == sf_tail) {
-			/* fifo is full */
-			goto done;
-		}
-		sf_head = i;
+	if (sf_room(n, class)) {
+		for (; *p; p += 2)
+			sf_put(p[0], p[1] > 0 ? p[1] * 10000 : 0, class, &when);
+		/* a rest, to carry the last note through */
+		sf_put(-1, 10000, class, &when);
+		if (!sf_busy)
+			sf_busy = start = true;
 	}
 
-	/* try to add on a rest, to carry the last note through */
-	sf_fifo[i++] = -1;
-	sf_fifo[i++] = 10;
-	if (i == SF_LEN)
-		i = 0;		/* wrap around */
-	if (i != sf_tail)
-		sf_head = i;
-
-done:
 	raw_spin_unlock_irqrestore(&soundfifo_lock, flags);
 
 	/* first sound,  get things started. */
-	if (wake)
-		pop_soundfifo(0);
+	sf_kick(start, class);
+}
+
+/* The next note in a scale, or 0 when the scale is done. */
+static int next_step(int f, int f2, int step)
+{
+	int g = f * (100 + step) / 100;
+
+	if (g == f || g < 50 || g > 8000)
+		return 0;
+	if ((step > 0 && g >= f2) || (step < 0 && g <= f2))
+		return 0;
+	return g;
 }
 
 /* Push an ascending or descending sequence of notes into the sound fifo.
  * Step is a geometric factor on frequency, increase by x percent.
  * 100% goes up by octaves, -50% goes down by octaves.
  * 12% is a wholetone scale, while 6% is a chromatic scale.
- * Duration is in milliseconds, for very fast frequency sweeps.  But this
- * is based on jiffies timing, so is subject to the resolution of HZ. */
-static void my_mksteps(int f1, int f2, int step, int duration)
+ * Duration is in milliseconds, for very fast frequency sweeps. */
+static void my_mksteps(int f1, int f2, int step, int duration, int class)
 {
-	int i;
-	bool wake = false;
+	unsigned int n = 1;	/* the rest at the end */
+	int f;
+	bool start = false;
 	unsigned long flags;
+	ktime_t when = ktime_get();
 
 	/* are the parameters in range? */
 	if (step != (char)step)
@@ -415,43 +562,27 @@ static void my_mksteps(int f1, int f2, int step, int duration)
 	/* avoid infinite loops */
 	if (step == 0 || (f1 < f2 && step < 0) || (f1 > f2 && step > 0))
 		return;
+	if (f1 == f2)
+		return;
+
+	for (f = f1; f; f = next_step(f, f2, step))
+		++n;
 
 	raw_spin_lock_irqsave(&soundfifo_lock, flags);
 
-	i = sf_head;
-	if (i == sf_tail)
-		wake = true;
-
-	/* Copy shorts into the fifo, until start reaches end */
-	while ((step > 0 && f1 < f2) || (step < 0 && f1 > f2)) {
-		sf_fifo[i++] = f1;
-		sf_fifo[i++] = duration;
-		if (i == SF_LEN)
-			i = 0;	/* wrap around */
-		if (i == sf_tail) {
-			/* fifo is full */
-			goto done;
-		}
-		sf_head = i;
-		f1 = f1 * (100 + step) / 100;
-		if (f1 < 50 || f1 > 8000)
-			break;
+	if (sf_room(n, class)) {
+		for (f = f1; f; f = next_step(f, f2, step))
+			sf_put(f, duration * 1000, class, &when);
+		/* a rest, to carry the last note through */
+		sf_put(-1, 10000, class, &when);
+		if (!sf_busy)
+			sf_busy = start = true;
 	}
 
-	/* try to add on a rest, to carry the last note through */
-	sf_fifo[i++] = -1;
-	sf_fifo[i++] = 10;
-	if (i == SF_LEN)
-		i = 0;		/* wrap around */
-	if (i != sf_tail)
-		sf_head = i;
-
-done:
 	raw_spin_unlock_irqrestore(&soundfifo_lock, flags);
 
 	/* first sound,  get things started. */
-	if (wake)
-		pop_soundfifo(0);
+	sf_kick(start, class);
 }
 
 /* Put a string of notes into the sound fifo. */
@@ -459,7 +590,7 @@ void ttyclicks_notes(const short *p)
 {
 	if (!ttyclicks_on)
 		return;
-	my_mknotes(p);
+	my_mknotes(p, SF_NORMAL);
 }				/* ttyclicks_notes */
 EXPORT_SYMBOL_GPL(ttyclicks_notes);
 
@@ -467,7 +598,7 @@ void ttyclicks_steps(int f1, int f2, int step, int duration)
 {
 	if (!ttyclicks_on)
 		return;
-	my_mksteps(f1, f2, step, duration);
+	my_mksteps(f1, f2, step, duration, SF_NORMAL);
 }				/* ttyclicks_steps */
 EXPORT_SYMBOL_GPL(ttyclicks_steps);
 
@@ -480,8 +611,8 @@ void ttyclicks_bell(void)
 }				/* ttyclicks_bell */
 EXPORT_SYMBOL_GPL(ttyclicks_bell);
 
-/* Returns a time in microseconds to wait. */
-static int soundFromChar(char c, int minor)
+/* Make the sound for a character; this never waits. */
+static void soundFromChar(char c, int minor)
 {
 	static const short capnotes[] = {
 		3000, 3, 0, 0
@@ -489,37 +620,39 @@ static int soundFromChar(char c, int minor)
 
 /* are sounds disabled? */
 	if (!ttyclicks_on)
-		return 0;
+		return;
 
 	if (c == '\07') {
 		ttyclicks_bell();
-		return 0;
+		return;
 	}
 
 	if (!ttyclicks_tty)
-		return 0;
+		return;
 
 /* Don't click for background screens */
 	if (minor != fg_console + 1)
-		return 0;
+		return;
 
 	if (c == '\n') {
 		ttyclicks_cr();
-		return 0;
+		return;
 	}
 
 	if (charIsEcho(c) && c >= 'A' && c <= 'Z') {
-		ttyclicks_notes(capnotes);
-		return TICKS_CHARWAIT;
+		my_mknotes(capnotes, SF_CHIRP);
+		click_push(0);
+		return;
 	}
 
 /* Treat a nonprintable characterlike a space; just pause. */
-	if (c >= 0 && c <= ' ')
-		return TICKS_CHARWAIT;
+	if (c >= 0 && c <= ' ') {
+		click_push(0);
+		return;
+	}
 
 /* regular printable character */
 	ttyclicks_click();
-	return TICKS_CHARWAIT - TICKS_CLICK;
 }				/* soundFromChar */
 
 /* Get char from the console, and make the sound. */
@@ -529,8 +662,6 @@ vt_out(struct notifier_block *this_nb, unsigned long type, void *data)
 	struct vt_notifier_param *param = data;
 	struct vc_data *vc = param->vc;
 	int minor = vc->vc_num + 1;
-	int msecs = 0, usecs = 0;
-	long jifpause;
 	int unicode = param->c;
 	char c = param->c;
 
@@ -572,7 +703,7 @@ vt_out(struct notifier_block *this_nb, unsigned long type, void *data)
 	if (!isdigit(c) && c != '?' && c != '#' && c != ';')
 		escState = 0;
 
-	usecs = soundFromChar(c, minor);
+	soundFromChar(c, minor);
 
 /*
  * If it's the bell, I make the beep, not the console.
@@ -582,30 +713,6 @@ vt_out(struct notifier_block *this_nb, unsigned long type, void *data)
 	if (c == 7)
 		return NOTIFY_STOP;
 
-	if (!usecs)
-		goto done;
-
-/*
-Tell the process to sleep.
-Can't suspend in the middle of a notifier.
-Best approach is to return NOTIFY_SLEEP, but that isn't implemented yet.
-*/
-
-	msecs = (usecs + 800) / 1000;
-	jifpause = msecs_to_jiffies(msecs);
-/* jifpause should always be positive, but let's make sure */
-	if (sleep && jifpause > 0) {
-		/*
-		 * This magical line of code only works if you edit vt.c
-		 * and recompile the kernel.
-		 * A patch is available from the acsint project.
-		 * Again, NOTIFY_SLEEP is a better solution.
-		 */
-		param->c = 0xac97;
-	} else {
-		udelay(usecs);
-	}
-
 done:
 	return NOTIFY_DONE;
 }				/* vt_out */
@@ -625,13 +732,31 @@ static int __init click_init(void)
 	ttyclicks_tty = fgtty;
 	ttyclicks_kmsg = kmsg;
 
+	hrtimer_init(&click_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+	click_timer.function = click_tick;
+
+	if (fifodepth < 16)
+		fifodepth = 16;
+	if (fifodepth > 4096)
+		fifodepth = 4096;
+	fifodepth = roundup_pow_of_two(fifodepth);
+	sf_fifo = kmalloc_array(fifodepth, sizeof(*sf_fifo), GFP_KERNEL);
+	if (!sf_fifo)
+		return -ENOMEM;
+	sf_mask = fifodepth - 1;
+	hrtimer_init(&sf_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+	sf_timer.function = pop_soundfifo;
+
 	rc = register_vt_notifier(&nb_vt);
-	if (rc)
+	if (rc) {
+		kfree(sf_fifo);
 		return rc;
+	}
 
 	rc = register_keyboard_notifier(&nb_key);
 	if (rc) {
 		unregister_vt_notifier(&nb_vt);
+		kfree(sf_fifo);
 		return rc;
 	}
 
@@ -648,9 +773,13 @@ static void __exit click_exit(void)
 	unregister_keyboard_notifier(&nb_key);
 	unregister_vt_notifier(&nb_vt);
 
-/* possible race conditions here with timers hanging around */
-	sf_head = sf_tail = 0;
-	pop_soundfifo(0);
+	hrtimer_cancel(&click_timer);
+	if (click_down)
+		speaker_toggle();
+
+	hrtimer_cancel(&sf_timer);
+	speaker_sing(0);
+	kfree(sf_fifo);
 }				/* click_exit */
 
 module_init(click_init);
@@ -11,6 +11,7 @@ as articulated by the Free Software Foundation.
 #include <fcntl.h>
 #include <unistd.h>
 #include <locale.h>
+#include <time.h>
 
 #include <linux/vt.h>
 
@@ -127,8 +128,9 @@ static const struct OUTWORDS const outwords[5] = {
 0
 
 },{ /* English */
-"usage:  jupiter [-d] [-c configfile] synthesizer port\n"
+"usage:  jupiter [-d] [-b n] [-c configfile] synthesizer port\n"
 "-d is daemon mode, run in background.\n"
+"-b n keeps n million characters of scrollback per console.\n"
 "Synthesizer is: dbe = doubletalk external,\n"
 "dte = dectalk external, dtp = dectalk pc,\n"
 "bns = braille n speak, ace = accent, esp = espeakup.\n"
@@ -161,8 +163,9 @@ static const struct OUTWORDS const outwords[5] = {
 
 },{ /* German, but still mostly English */
 
-"usage:  jupiter [-d] [-c configfile] synthesizer port\n"
+"usage:  jupiter [-d] [-b n] [-c configfile] synthesizer port\n"
 "-d is daemon mode, run in background.\n"
+"-b n keeps n million characters of scrollback per console.\n"
 "Synthesizer is: dbe = doubletalk external,\n"
 "dte = dectalk external, dtp = dectalk pc,\n"
 "bns = braille n speak, ace = accent, esp = espeakup.\n"
@@ -195,8 +198,9 @@ static const struct OUTWORDS const outwords[5] = {
 
 },{ /* Brazilian Portuguese */
 
-"uso: jupiter [-d] [-c arq. de config.] sintetizador porta\n"
+"uso: jupiter [-d] [-b n] [-c arq. de config.] sintetizador porta\n"
 "-d é modo daemon, roda em segundo plano.\n"
+"-b n guarda n milhões de caracteres de histórico por console.\n"
 "Sintetizador é: dbe = doubletalk externo,\n"
 "dte = dectalk externo, dtp = dectalk pc,\n"
 "bns = braille n speak, ace = accent, esp = espeakup.\n"
@@ -374,6 +378,9 @@ char *s;
 int i, lineno, rc;
 char filename[SUPPORTLEN+20];
 
+/* The key bindings go down to the driver all at once, at the end. */
+acs_batchkeys(1);
+
 /* everything has been cleared; start with the cut&paste strings */
 for(i=0; i<26; ++i) {
 if(!cp_macro[i]) continue;
@@ -385,6 +392,7 @@ strcpy(filename, my_config);
 f = fopen(filename, "r");
 if(!f) {
 fprintf(stderr, o->openConfig, filename);
+acs_batchkeys(0);
 return;
 }
 
@@ -426,6 +434,7 @@ fprintf(stderr, "\n");
 }
 
 fclose(f);
+acs_batchkeys(0);
 } // j_configure
 
 
@@ -447,8 +456,9 @@ static char keyInterrupt;
 static char goRead, goRead2; /* read the next sentence */
 /* for cut&paste */
 #define markleft acs_mb->marks[26]
-static unsigned int *markright;
+static acs_pos_type markright;
 static char screenMode = 0;
+static void screen_h(int row, int col);
 static char smlist[MAX_NR_CONSOLES+1];
 static char *cfglist[MAX_NR_CONSOLES+1];
 static char jdebug;
@@ -505,6 +515,7 @@ if(acs_screenmode(*p)) {
 screenMode = 0;
 acs_buzz();
 }
+acs_screen_h = (screenMode ? screen_h : 0);
 smlist[acs_fgc] = screenMode;
 ctrack = 1;
 /* this line is really important; don't leave the temp cursor in the other world. */
@@ -521,6 +532,18 @@ break;
 } // switch
 } /* binmode */
 
+/* the next sentence, ready to speak; see lookAhead() below */
+static struct {
+	int valid;
+	const struct acs_readingBuffer *rb;
+	acs_pos_type from, next, end;
+	unsigned int gen;
+	int gsprop;
+	int len;
+	unsigned int buf[400];
+	acs_ofs_type offset[400];
+} ahead;
+
 /*********************************************************************
 An event is interrupting speech.
 Key command, echoed character, console switch.
@@ -531,19 +554,143 @@ static void interrupt(void)
 {
 acs_rb = 0;
 goRead = 0;
+ahead.valid = 0;
 if(acs_stillTalking())
 acs_shutup();
 }
 
 #define readNextMark acs_rb->marks[27]
 
+/*********************************************************************
+Grab a sentence at the reading cursor, and get it ready to speak, in tp_out.
+Return 0 if there is nothing to read,
+2 if the sentence starts with newline or bell, which the caller speaks,
+with tp_in holding the sentence as it came from the buffer,
+and 1 if tp_out is ready to go.
+*********************************************************************/
+
+static int prepSentence(int gsprop)
+{
+int i;
+unsigned int *end; /* the end of the sentence */
+unsigned int first; /* first character of the sentence */
+
+acs_log("nextpart 0x%x\n", acs_bufchar(acs_rb, acs_rb->cursor));
+tp_in->buf[0] = 0;
+tp_in->offset[0] = 0;
+acs_getsentence(tp_in->buf+1, 120, tp_in->offset+1, gsprop);
+
+if(!tp_in->buf[1]) return 0;
+
+first = tp_in->buf[1];
+if(first == '\n' || first == '\7') return 2;
+
+if(jdebug) {
+char *w = acs_uni2utf8(tp_in->buf+1);
+if(w) {
+acs_log("insentence %s\n", w);
+free(w);
+}
+}
+
+tp_in->len = 1 + acs_unilen(tp_in->buf+1);
+/* If the sentence runs all the way to the end of the buffer,
+ * then we might be in the middle of printing a word.
+ * We don't want to read half the word, then come back and refresh
+ * and read the other half.  So back up to the beginning of the word.
+ * Nor do we want to hear the word return, when newline is about to follow.
+ * Despite this code, it is still possible to hear part of a word,
+ * or the cr in crlf, if the output is delayed for some reason. */
+end = tp_in->buf + tp_in->len - 1;
+if(*end == '\r') {
+if(tp_in->len > 2 && tp_in->offset[tp_in->len-1])
+*end = 0, --tp_in->len;
+} else if(acs_isalnum(*end)) {
+for(--end; *end; --end)
+if(!acs_isalnum(*end)) break;
+if(*end++ && tp_in->offset[end-tp_in->buf]) {
+*end = 0;
+tp_in->len = end - tp_in->buf;
+}
+}
+
+prepTTS();
+
+/* Cut the text at a logical sentence, as indicated by newline.
+ * If newline wasn't already present in the input, this has been
+ * set for you by prepTTS. */
+for(end=tp_out->buf+1; *end; ++end)
+if(*end == '\n' || *end == '\7') break;
+*end = 0;
+tp_out->len = end - tp_out->buf;
+
+/* An artificial newline, inserted by prepTTS to denote a sentence boundary,
+ * won't have an offset.  In that case we need to grab the next one. */
+i = tp_out->len;
+while(!tp_out->offset[i]) ++i;
+tp_out->offset[tp_out->len] = tp_out->offset[i];
+
+return 1;
+} /* prepSentence */
+
+/*********************************************************************
+Speak ahead.  While one sentence is being spoken, get the next one ready,
+so it can go to the synth the moment the last index marker comes back.
+It is only good if nothing has changed:
+the reading cursor is where this sentence starts,
+the text under it is the same, and we're reading it the same way.
+New output at the end of the buffer doesn't matter,
+unless the sentence ran into the end of the buffer.
+A key command throws it away, see interrupt() above.
+*********************************************************************/
+
+static void lookAhead(int gsprop)
+{
+acs_pos_type save = acs_rb->cursor;
+int i;
+
+ahead.valid = 0;
+if(!readNextMark || readNextMark >= acs_rb->end) return;
+acs_rb->cursor = readNextMark;
+i = prepSentence(gsprop);
+acs_rb->cursor = save;
+if(i != 1) return;
+if(tp_out->len >= sizeof(ahead.buf)/sizeof(ahead.buf[0])) return;
+
+ahead.rb = acs_rb;
+ahead.from = readNextMark;
+ahead.next = readNextMark + tp_out->offset[tp_out->len];
+ahead.end = acs_rb->end;
+ahead.gen = acs_rb->gen;
+ahead.gsprop = gsprop;
+ahead.len = tp_out->len;
+memcpy(ahead.buf, tp_out->buf, (tp_out->len+1) * sizeof(unsigned int));
+memcpy(ahead.offset, tp_out->offset, (tp_out->len+1) * sizeof(acs_ofs_type));
+ahead.valid = 1;
+acs_log("ahead %d\n", ahead.len);
+} /* lookAhead */
+
+static int useAhead(int gsprop)
+{
+if(!ahead.valid) return 0;
+ahead.valid = 0;
+if(ahead.rb != acs_rb || ahead.from != acs_rb->cursor ||
+ahead.gen != acs_rb->gen || ahead.gsprop != gsprop ||
+ahead.from < acs_rb->start)
+return 0;
+if(ahead.end != acs_rb->end && ahead.next >= ahead.end)
+return 0;
+memcpy(tp_out->buf, ahead.buf, (ahead.len+1) * sizeof(unsigned int));
+memcpy(tp_out->offset, ahead.offset, (ahead.len+1) * sizeof(acs_ofs_type));
+tp_out->len = ahead.len;
+return 1;
+} /* useAhead */
+
 static void
 readNextPart(void)
 {
 int gsprop;
 int i;
-unsigned int *end; /* the end of the sentence */
-unsigned int first; /* first character of the sentence */
 static int flip = 1; /* flip between two ranges of numbers */
 
 acs_refresh(); /* whether we need to or not */
@@ -574,27 +721,25 @@ gsprop |= ACS_GS_STOPLINE;
 else
 gsprop |= ACS_GS_NLSPACE;
 
+if(useAhead(gsprop)) goto speak;
+
 top:
 /* grab something to read */
-acs_log("nextpart 0x%x\n", acs_rb->cursor[0]);
-tp_in->buf[0] = 0;
-tp_in->offset[0] = 0;
-acs_getsentence(tp_in->buf+1, 120, tp_in->offset+1, gsprop);
+i = prepSentence(gsprop);
 
-if(!tp_in->buf[1]) {
+if(!i) {
 /* Empty sentence, nothing else to read. */
 acs_log("empty done\n");
 acs_rb = 0;
 return;
 }
 
-first = tp_in->buf[1];
-if(first == '\n' || first == '\7') {
+if(i == 2) {
 /* starts out with newline or bell, which is usually associated with a sound */
 /* This will swoop/beep with clicks on, or say the word newline or bell with clicks off */
 speakChar(tp_in->buf[1], 1, soundsOn, 0);
 
-if(oneLine && first == '\n') {
+if(oneLine && tp_in->buf[1] == '\n') {
 acs_log("newline done\n");
 acs_rb = 0;
 return;
@@ -616,54 +761,13 @@ return;
 goto top;
 }
 
-if(jdebug) {
-char *w = acs_uni2utf8(tp_in->buf+1);
-if(w) {
-acs_log("insentence %s\n", w);
-free(w);
-}
-}
-
-tp_in->len = 1 + acs_unilen(tp_in->buf+1);
-/* If the sentence runs all the way to the end of the buffer,
- * then we might be in the middle of printing a word.
- * We don't want to read half the word, then come back and refresh
- * and read the other half.  So back up to the beginning of the word.
- * Nor do we want to hear the word return, when newline is about to follow.
- * Despite this code, it is still possible to hear part of a word,
- * or the cr in crlf, if the output is delayed for some reason. */
-end = tp_in->buf + tp_in->len - 1;
-if(*end == '\r') {
-if(tp_in->len > 2 && tp_in->offset[tp_in->len-1])
-*end = 0, --tp_in->len;
-} else if(acs_isalnum(*end)) {
-for(--end; *end; --end)
-if(!acs_isalnum(*end)) break;
-if(*end++ && tp_in->offset[end-tp_in->buf]) {
-*end = 0;
-tp_in->len = end - tp_in->buf;
-}
-}
-
-prepTTS();
-
-/* Cut the text at a logical sentence, as indicated by newline.
- * If newline wasn't already present in the input, this has been
- * set for you by prepTTS. */
-for(end=tp_out->buf+1; *end; ++end)
-if(*end == '\n' || *end == '\7') break;
-*end = 0;
-tp_out->len = end - tp_out->buf;
-
-/* An artificial newline, inserted by prepTTS to denote a sentence boundary,
- * won't have an offset.  In that case we need to grab the next one. */
-i = tp_out->len;
-while(!tp_out->offset[i]) ++i;
-tp_out->offset[tp_out->len] = tp_out->offset[i];
-
+speak:
 readNextMark = acs_rb->cursor + tp_out->offset[tp_out->len];
 //flip = 51 - flip;
 acs_say_indexed(tp_out->buf+1, tp_out->offset+1, flip);
+
+/* The synth has it; get the next one ready while this one is spoken. */
+lookAhead(gsprop);
 } /* readNextPart */
 
 /* index mark handler, read next sentence if we finished the last one */
@@ -686,7 +790,7 @@ The conversion routine is part of the acsint bridge layer.
 static int dumpBuffer(void)
 {
 int fd, l, n;
-char *utf8 =  acs_uni2utf8(acs_mb->start);
+char *utf8 =  acs_buf2utf8(acs_mb, acs_mb->start, acs_mb->end);
 if(!utf8) return -1;
 sprintf(shortPhrase, "/tmp/buf%d", acs_fgc);
 fd = open(shortPhrase, O_WRONLY|O_CREAT|O_TRUNC, 0666);
@@ -724,9 +828,11 @@ acs_sounds(0);
 
 static void unsuspend(void)
 {
+acs_batchkeys(1);
 acs_reset_configure();
 etcjup(cfglist[acs_fgc]);
 j_configure(jfile, 0);
+acs_batchkeys(0);
 if(suspendClicks) {
 soundsOn = 1;
 acs_sounds(1);
@@ -865,23 +971,15 @@ ctrack = 1;
 	case 12: if(!acs_forward()) goto error_bound; break;
 
 	case 13: /* up a row */
-		n = acs_startline();
-		if(!acs_back()) goto error_bound;
-		acs_startline();
-		for(i=1; i<n; ++i) {
-			if(acs_getc() == '\n') goto error_bell;
-acs_forward();
-		}
+		n = acs_column();
+		if(!acs_moveline(-1)) goto error_bound;
+		if(acs_column() != n) goto error_bell;
 		break;
 
 	case 14: /* down a row */
-		n = acs_startline();
-acs_endline();
-		if(!acs_forward()) goto error_bound;
-		for(i=1; i<n; ++i) {
-			if(acs_getc() == '\n') goto error_bell;
-			if(!acs_forward()) goto error_bound;
-		}
+		n = acs_column();
+		if(!acs_moveline(1)) goto error_bound;
+		if(acs_column() != n) goto error_bell;
 		break;
 
 /* read character, or cap character, or word for character */
@@ -1065,10 +1163,7 @@ if(markright < markleft) goto error_bound;
 ++markright;
 i = markright - markleft;
 if(i + n >= sizeof(cutbuf)) goto error_bound;
-c = *markright; // save this value
-*markright = 0;
-cut8 = acs_uni2utf8(markleft);
-*markright = c; // put it back
+cut8 = acs_buf2utf8(acs_mb, markleft, markright);
 if(!cut8) goto error_bell;
 if(n + strlen(cut8) >= sizeof(cutbuf)) { free(cut8); goto error_bound; }
 i = support - 'a';
@@ -1137,8 +1232,10 @@ if(!quiet) {
 acs_cr();
 acs_say_string(o->reloadword);
 }
+acs_batchkeys(1);
 acs_reset_configure();
 j_configure(jfile, 1);
+acs_batchkeys(0);
 return;
 
 case 47: /* dump tty buffer to a file */
@@ -1214,6 +1311,7 @@ return; /* should never happen */
 if(screenMode != smlist[acs_fgc]) {
 screenMode = smlist[acs_fgc];
 acs_screenmode(screenMode);
+acs_screen_h = (screenMode ? screen_h : 0);
 ctrack = 1;
 }
 
@@ -1240,9 +1338,11 @@ goto done;
 }
 
 if(!stringEqual(cfglist[last_fgc], cfglist[acs_fgc])) {
+acs_batchkeys(1);
 acs_reset_configure();
 etcjup(cfglist[acs_fgc]);
 j_configure(jfile, 0);
+acs_batchkeys(0);
 }
 
 done:
@@ -1286,6 +1386,15 @@ if(!autoRead) return;
 if(!echo) goRead = 1;
 } /* more_h */
 
+/* The screen changed, in screen mode.
+ * The bridge has already read the cursor position;
+ * waking up the main loop, to look at it, is all we need. */
+static void screen_h(int row, int col)
+{
+if(suspended) return;
+ctrack = 1;
+} /* screen_h */
+
 static void
 openSound(void)
 {
@@ -1403,6 +1512,15 @@ setsid();
 continue;
 }
 
+if(argc && stringEqual(argv[0], "-b")) {
+++argv, --argc;
+if(argc) {
+acs_scrollback = atol(argv[0]) * 1000000;
+++argv, --argc;
+}
+continue;
+}
+
 if(argc && stringEqual(argv[0], "-c")) {
 ++argv, --argc;
 if(argc) {
@@ -1522,6 +1640,18 @@ acs_log("lc %d,%d\n", lastrow, lastcol);
 
 while(1) {
 char newcmd[8];
+static time_t last_bg;
+time_t now;
+
+/* Nothing to read, so catch up the other consoles in the meantime,
+ * but not more than once a second; they aren't going anywhere. */
+if(!acs_rb) {
+now = time(0);
+if(now != last_bg) {
+last_bg = now;
+acs_bg_refresh();
+}
+}
 
 acs_all_events();
 
@@ -1549,7 +1679,7 @@ refetch:
 usleep(100000);
 acs_rb = acs_tb;
 readNextMark = acs_rb->end;
-acs_log("mark1 %d\n", readNextMark - acs_rb->start);
+acs_log("mark1 %d\n", (int)(readNextMark - acs_rb->start));
 /* The refresh is really a call to events() in disguise.
  * So any of those handlers could be called.
  * Since acs_rb is set, more_h won't cause any trouble. */
@@ -1559,11 +1689,11 @@ if(last_key) goto key_command;
 /* did reading get killed for any other reason, e.g. console switch? */
 if(!acs_rb) { acs_log("read off\n"); continue; }
 if(!readNextMark) { acs_rb = 0; acs_log("mark off\n"); continue; }
-acs_log("mark2 %d\n", readNextMark - acs_rb->start);
+acs_log("mark2 %d\n", (int)(readNextMark - acs_rb->start));
 
-if(!*readNextMark) { acs_rb = 0; goto autoscreen; }
+if(!acs_bufchar(acs_rb, readNextMark)) { acs_rb = 0; goto autoscreen; }
 
-while(c = *readNextMark) {
+while(c = acs_bufchar(acs_rb, readNextMark)) {
 if(c != ' ' && c != '\n' &&
 c != '\r' && c != '\7')
 break;
@@ -1571,7 +1701,7 @@ break;
 }
 if(!c) goto refetch;
 
-acs_log("mark3 %d %c\n", readNextMark - acs_rb->start, c);
+acs_log("mark3 %d %c\n", (int)(readNextMark - acs_rb->start), c);
 // autoread turns off oneLine mode.
 oneLine = 0;
 if(screenMode) {
@@ -1589,7 +1719,7 @@ if(!autoRead) continue;
 
 if(!goRead2 || acs_rb) {
 // note the (possibly new) position of the cursor; that's it.
-acs_vc();
+// Screen events keep acs_vc_row and acs_vc_col current.
 lastrow = acs_vc_row, lastcol = acs_vc_col;
 acs_log("lc %d,%d\n", lastrow, lastcol);
 continue;
@@ -1602,15 +1732,15 @@ acs_log("vc %d,%d\n", acs_vc_row, acs_vc_col);
 if(acs_vc_row == lastrow && (acs_vc_col == lastcol+1 || acs_vc_col == lastcol-1)) {
 acs_mb->cursor = acs_mb->v_cursor;
 autoletter:
-acs_log("autochar %c\n", acs_mb->cursor[0]);
-		speakChar(acs_mb->cursor[0], 1, soundsOn, 1);
+acs_log("autochar %c\n", acs_bufchar(acs_mb, acs_mb->cursor));
+		speakChar(acs_bufchar(acs_mb, acs_mb->cursor), 1, soundsOn, 1);
 goto updatecursor;
 }
 
 // read new word if you arrowed left or right one word
 if(acs_vc_row == lastrow && acs_vc_col != lastcol) {
 acs_mb->cursor = acs_mb->v_cursor;
-acs_log("autoword %c\n", acs_mb->cursor[0]);
+acs_log("autoword %c\n", acs_bufchar(acs_mb, acs_mb->cursor));
 newcmd[0] = cmdByName("word");
 newcmd[1] = cmdByName("cursor");
 newcmd[2] = 0;
@@ -1621,7 +1751,7 @@ goto updatecursor;
 // read new line if you arrowed up or down one line
 if(acs_vc_row == lastrow+1 || acs_vc_row == lastrow-1) {
 acs_mb->cursor = acs_mb->v_cursor;
-acs_log("autoline %c\n", acs_mb->cursor[0]);
+acs_log("autoline %c\n", acs_bufchar(acs_mb, acs_mb->cursor));
 newcmd[0] = cmdByName("sline");
 newcmd[1] = cmdByName("stmode");
 newcmd[2] = '1';